@@ -39,4 +39,62 @@ void accel_invert128(uint64_t addr);
 __attribute__((naked))
 void accel_invert256(uint64_t addr);
 
+__attribute__((naked))
+void accel_invert512(uint64_t addr);
+
+/*
+ * Invert a tail of `len' bytes, shorter than the kernel width, in
+ * one (AVX-512, masked) or two (AVX2, overlapping) operations.
+ */
+__attribute__((naked))
+void accel_invert_tail256(uint64_t addr, uint64_t len);
+
+__attribute__((naked))
+void accel_invert_tail512(uint64_t addr, uint64_t len);
+
+/*
+ * Bulk kernels: invert `len' bytes at `addr', which must be aligned
+ * to the kernel width, `len' being a multiple of 64. The _nt
+ * variants use non-temporal stores.
+ */
+__attribute__((naked))
+void accel_invert_bulk128(uint64_t addr, uint64_t len);
+
+__attribute__((naked))
+void accel_invert_bulk256(uint64_t addr, uint64_t len);
+
+__attribute__((naked))
+void accel_invert_bulk512(uint64_t addr, uint64_t len);
+
+__attribute__((naked))
+void accel_invert_nt128(uint64_t addr, uint64_t len);
+
+__attribute__((naked))
+void accel_invert_nt256(uint64_t addr, uint64_t len);
+
+__attribute__((naked))
+void accel_invert_nt512(uint64_t addr, uint64_t len);
+
+/*
+ * Size-specialised kernels: invert exactly 4 KiB or 64 KiB at
+ * `addr', no alignment required.
+ */
+__attribute__((naked))
+void accel_invert4k_128(uint64_t addr);
+
+__attribute__((naked))
+void accel_invert4k_256(uint64_t addr);
+
+__attribute__((naked))
+void accel_invert4k_512(uint64_t addr);
+
+__attribute__((naked))
+void accel_invert64k_128(uint64_t addr);
+
+__attribute__((naked))
+void accel_invert64k_256(uint64_t addr);
+
+__attribute__((naked))
+void accel_invert64k_512(uint64_t addr);
+
 #endif  /* ACCEL_H */
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2023-2024 Ian Marco Moffett and the Osmora team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Osmora nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <info.h>
+
+/*
+ * Wire format of the daemon's SOCK_SEQPACKET socket. One request per
+ * packet, optionally carrying the file as an SCM_RIGHTS descriptor
+ * (opened O_RDWR by the client), in which case `path' is ignored.
+ * The path may be truncated to its terminating NUL. Every request
+ * gets exactly one reply.
+ */
+#define DAEMON_MAGIC        0x46424f46  /* "FOBF" */
+#define DAEMON_PATH_MAX     4096
+#define DAEMON_CHUNK        (4UL << 20)
+
+#define DAEMON_MODE_INPLACE     0       /* Range in place */
+#define DAEMON_MODE_ATOMIC      1       /* Whole file, by path only */
+#define DAEMON_MODE_RESUMABLE   2       /* Whole file, by path only */
+#define DAEMON_MODE_SHM         3       /* Attach a ring, see shmring.h */
+
+struct daemon_req {
+    uint32_t magic;
+    uint32_t mode;
+    uint64_t off;
+    uint64_t len;                       /* 0 means to the end */
+    char path[DAEMON_PATH_MAX];
+};
+
+struct daemon_reply {
+    uint32_t magic;
+    int32_t error;                      /* 0 or an errno value */
+    uint64_t bytes;                     /* Bytes inverted */
+    uint64_t nsec;                      /* Time spent serving it */
+};
+
+int daemon_serve(const struct cpu_info *info, const char *sock_path,
+                 int nthreads);
+int daemon_request(const char *sock_path, char **paths, size_t npaths,
+                   int mode);
+
+#endif  /* DAEMON_H */
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2023-2024 Ian Marco Moffett and the Osmora team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Osmora nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ENCRYPT_H
+#define ENCRYPT_H
+
+#include <stddef.h>
+#include <info.h>
+
+/* Kernels, narrowest to widest */
+#define ENCRYPT_SCALAR      0
+#define ENCRYPT_SSE         1
+#define ENCRYPT_AVX         2
+#define ENCRYPT_AVX512      3
+#define ENCRYPT_NKERNEL     4
+
+#define ENCRYPT_MAX_THREADS 256
+
+/* Sizes with specialised kernels, see encrypt_fixed() */
+#define ENCRYPT_PAGE        4096
+#define ENCRYPT_BLOCK       65536
+
+int encrypt_max_kernel(const struct cpu_info *info);
+const char *encrypt_kernel_name(int kernel);
+const char *encrypt_kernel(const struct cpu_info *info);
+char *encrypt(const struct cpu_info *info, char *buf, size_t buf_size);
+char *encrypt_fixed(const struct cpu_info *info, char *buf, size_t buf_size);
+char *encrypt_parallel(const struct cpu_info *info, char *buf, size_t buf_size,
+                       int nthreads);
+
+#endif  /* ENCRYPT_H */
@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2023-2024 Ian Marco Moffett and the Osmora team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Osmora nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef FILEIO_H
+#define FILEIO_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <limits.h>
+
+/*
+ * Every file we create next to a target (atomic temporaries, -r
+ * journals) is named SIDECAR_PREFIX<name>..., and only such names are
+ * skipped when walking or batching.
+ */
+#define SIDECAR_PREFIX  ".fobtmp."
+
+/* Streams at least this long get writeback smoothing */
+#define IO_SMOOTH_MIN   (64UL << 20)
+
+/*
+ * A sequential pass over a range of a file, for readahead and
+ * writeback hints. See io_stream_init().
+ */
+struct io_stream {
+    int fd;
+    bool smooth;
+    off_t prev_off;         /* Last chunk written, writeback started */
+    size_t prev_len;
+};
+
+/* A replacement being written, see atomic_open() */
+struct atomic_tmp {
+    int fd;
+    struct stat st;         /* Of the file being replaced */
+    char dir[PATH_MAX];
+    char tmpname[PATH_MAX]; /* Empty while the temporary is unnamed */
+    bool marked;            /* Original tagged SPARSE_XATTR */
+};
+
+bool is_sidecar(const char *path);
+int sidecar_path(char *out, size_t out_size, const char *fname,
+                 const char *suffix);
+int sync_parent(const char *path);
+
+char *read_file(const char *fname, size_t max, size_t *size_out);
+int writeback_file(const char *fname, const char *buf, size_t buf_size);
+int writeback_atomic(const char *fname, const char *buf, size_t buf_size);
+int atomic_open(struct atomic_tmp *at, const char *fname);
+int atomic_commit(struct atomic_tmp *at, const char *fname);
+void atomic_abort(struct atomic_tmp *at);
+
+ssize_t read_full(int fd, char *buf, size_t len);
+int write_full(int fd, const char *buf, size_t len);
+ssize_t pread_full(int fd, char *buf, size_t len, off_t off);
+int pwrite_full(int fd, const char *buf, size_t len, off_t off);
+
+void io_stream_init(struct io_stream *ios, int fd, off_t off, off_t len,
+                    bool smooth);
+void io_stream_read(struct io_stream *ios, off_t off, size_t len);
+void io_stream_written(struct io_stream *ios, off_t off, size_t len);
+void io_stream_finish(struct io_stream *ios);
+
+#endif  /* FILEIO_H */
@@ -31,11 +31,16 @@
 #define INFO_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 struct cpu_info {
     uint8_t has_sse2 : 1;
     uint8_t has_sse3 : 1;
     uint8_t has_avx  : 1;
+    uint8_t has_avx2 : 1;
+    uint8_t has_avx512 : 1;     /* AVX-512 F and BW */
 };
 
+void cpu_detect(struct cpu_info *info, bool verbose);
+
 #endif      /* INFO_H */
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2023-2024 Ian Marco Moffett and the Osmora team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Osmora nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+
+#define JOURNAL_SUFFIX  ".fobj"
+#define JOURNAL_MAGIC   0x4A424F46      /* "FOBJ" */
+#define JOURNAL_VERSION 1
+
+#define JOURNAL_CHUNK   (4UL << 20)     /* Bytes committed per record */
+#define JOURNAL_PAGE    4096            /* Granularity of torn-write checks */
+#define JOURNAL_NPAGES  (JOURNAL_CHUNK / JOURNAL_PAGE)
+#define JOURNAL_SLOT    8192            /* On-disk size of one record slot */
+
+/* State of a page in the chunk that was in flight at a crash */
+#define JOURNAL_PAGE_ORIG   0           /* Not yet inverted */
+#define JOURNAL_PAGE_DONE   1           /* Already inverted */
+#define JOURNAL_PAGE_TORN   2           /* Neither, cannot recover */
+
+/*
+ * One journal record. Two slots are kept on disk and written
+ * alternately so a torn record write never loses the previous one;
+ * the valid slot with the highest `seq' wins.
+ *
+ * `committed' is the number of bytes from the start of the file that
+ * are known to be inverted and synced. If `pending_len' is non-zero
+ * the chunk right after it may be partially written; `page_sum' then
+ * holds checksums of its original pages so each page can be
+ * classified on resume.
+ */
+struct journal_rec {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t seq;
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    uint64_t chunk_size;
+    uint64_t committed;
+    uint64_t pending_len;
+    uint32_t page_sum[JOURNAL_NPAGES];
+    uint32_t rec_sum;
+};
+
+struct journal {
+    int fd;
+    char path[PATH_MAX];
+    struct journal_rec rec;
+};
+
+int journal_open(struct journal *jp, const char *fname, const struct stat *st);
+int journal_intent(struct journal *jp, off_t off, const char *buf, size_t len);
+int journal_page_state(const struct journal *jp, size_t idx, const char *page,
+                       size_t len);
+void journal_finish(struct journal *jp);
+void journal_close(struct journal *jp);
+
+#endif  /* JOURNAL_H */
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2023-2024 Ian Marco Moffett and the Osmora team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Osmora nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PERF_H
+#define PERF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#define PERF_CYCLES     0
+#define PERF_INSTR      1
+#define PERF_LLC_MISS   2
+#define PERF_DTLB_MISS  3
+#define PERF_NEVENT     4
+
+struct perf {
+    bool enabled;
+    bool json;
+    uint64_t bytes;
+    uint64_t count[PERF_NEVENT];
+    bool have[PERF_NEVENT];     /* Counter opened on at least one thread */
+};
+
+/* Counter values at the start of a sampled region */
+struct perf_sample {
+    uint64_t start[PERF_NEVENT];
+    bool valid;
+};
+
+extern struct perf g_perf;
+
+void perf_init(bool json);
+void perf_read(struct perf_sample *ps);
+void perf_end(struct perf_sample *ps, size_t bytes);
+void perf_report(FILE *fp);
+
+/*
+ * Counters are per thread and opened on first use from each thread,
+ * so any worker calling encrypt() is covered. No-op unless --perf.
+ */
+static inline void
+perf_begin(struct perf_sample *ps)
+{
+    ps->valid = false;
+    if (g_perf.enabled) {
+        perf_read(ps);
+    }
+}
+
+#endif  /* PERF_H */
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2023-2024 Ian Marco Moffett and the Osmora team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Osmora nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <info.h>
+
+/*
+ * Shared-memory request ring between a client and the daemon.
+ *
+ * The client creates a memfd (with MFD_ALLOW_SEALING), sizes it, seals
+ * it with F_SEAL_SHRINK | F_SEAL_GROW, lays out a struct shmring at
+ * its start and hands the fd to the daemon with a DAEMON_MODE_SHM
+ * request; unsealed fds are refused with EPERM. From
+ * then on buffers are exchanged without copies or socket traffic:
+ * the client puts data anywhere past SHMRING_DATA(nslots), fills in
+ * desc[head % nslots] and bumps `head'; the daemon inverts the data
+ * in place, sets the descriptor's `error' and bumps `tail'. `head'
+ * and `tail' double as futex words, and a side only issues
+ * FUTEX_WAKE when the other has said (in `sleeping'/`waiting') that
+ * it is about to block, so a busy ring makes no system calls at all.
+ *
+ * The client sets `closed' and wakes `head' when it is done.
+ */
+#define SHMRING_MAGIC   0x52424f46      /* "FOBR" */
+#define SHMRING_MAX     4096            /* Most slots in a ring */
+
+struct shmring_desc {
+    uint64_t off;               /* Of the data, from the ring's start */
+    uint64_t len;
+    int32_t error;              /* 0 or an errno value, set by the daemon */
+    uint32_t pad;
+};
+
+struct shmring {
+    uint32_t magic;
+    uint32_t nslots;            /* Power of two */
+    uint32_t head;              /* Submitted by the client */
+    uint32_t tail;              /* Completed by the daemon */
+    uint32_t closed;            /* Client is gone */
+    uint32_t sleeping;          /* Daemon is waiting on `head' */
+    uint32_t waiting;           /* Client is waiting on `tail' */
+    uint32_t pad;
+    struct shmring_desc desc[];
+};
+
+/* Where the data area starts, page aligned */
+#define SHMRING_DATA(nslots) \
+    ((sizeof(struct shmring) + (nslots) * sizeof(struct shmring_desc) + \
+      4095) & ~(size_t)4095)
+
+int shmring_serve(const struct cpu_info *info, int memfd, int sock);
+int shmring_filter(const char *sock_path, int in_fd, int out_fd);
+
+#endif  /* SHMRING_H */
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2023-2024 Ian Marco Moffett and the Osmora team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Osmora nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <info.h>
+
+/* Tag of files left in hole-preserving inverted form */
+#define SPARSE_XATTR    "user.fobfuscate.sparse"
+
+/* Largest piece of a data extent read at once */
+#define SPARSE_CHUNK    (4UL << 20)
+
+/*
+ * True if `st' has fewer blocks allocated than its size needs, i.e.
+ * it (probably) has holes. Dense files skip the extent walk.
+ */
+static inline bool
+sparse_file(const struct stat *st)
+{
+    return S_ISREG(st->st_mode) && (off_t)st->st_blocks * 512 < st->st_size;
+}
+
+bool sparse_marked(int fd);
+void sparse_mark(int fd, bool on);
+int sparse_check(int fd, const struct stat *st, const char *fname);
+int sparse_next_data(int fd, off_t off, off_t end, off_t *start_out,
+                     off_t *end_out);
+int sparse_invert_buf(const struct cpu_info *info, int fd, char *buf,
+                      off_t off, size_t len, bool writeback);
+int sparse_invert_file(const struct cpu_info *info, int fd, const char *fname,
+                       size_t size);
+int sparse_encrypt(const struct cpu_info *info, const char *fname, char *buf,
+                   size_t size);
+
+#endif  /* SPARSE_H */
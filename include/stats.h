@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2023-2024 Ian Marco Moffett and the Osmora team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Osmora nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#define STATS_CPU       0       /* CPU feature detection */
+#define STATS_READ      1       /* Getting data into memory */
+#define STATS_INVERT    2       /* encrypt() */
+#define STATS_WRITE     3       /* Getting data back out, incl. syncs */
+#define STATS_NPHASE    4
+
+struct stats {
+    bool enabled;
+    bool json;
+    const char *kernel;
+    uint64_t start_ns;
+    uint64_t ns[STATS_NPHASE];
+    uint64_t bytes[STATS_NPHASE];
+};
+
+extern struct stats g_stats;
+
+uint64_t stats_now(void);
+void stats_init(bool json);
+void stats_report(FILE *fp);
+
+/*
+ * Bracket a phase with these. Both are no-ops unless --stats was
+ * given; stats_end() may be called from several threads at once, in
+ * which case phase times add up across threads.
+ */
+static inline uint64_t
+stats_begin(void)
+{
+    return g_stats.enabled ? stats_now() : 0;
+}
+
+static inline void
+stats_end(int phase, uint64_t start, size_t bytes)
+{
+    if (!g_stats.enabled) {
+        return;
+    }
+
+    __atomic_fetch_add(&g_stats.ns[phase], stats_now() - start,
+                       __ATOMIC_RELAXED);
+    __atomic_fetch_add(&g_stats.bytes[phase], bytes, __ATOMIC_RELAXED);
+}
+
+#endif  /* STATS_H */
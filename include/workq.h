@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2023-2024 Ian Marco Moffett and the Osmora team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Osmora nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef WORKQ_H
+#define WORKQ_H
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+struct workq;
+struct wq_worker;
+
+/*
+ * A unit of work. `run' owns the task and must free it; it may push
+ * further tasks from inside.
+ */
+struct wq_task {
+    void (*run)(struct wq_worker *w, struct wq_task *task);
+    void *arg;
+    off_t off;
+    size_t len;
+};
+
+/* Per-worker deque; the owner works the bottom, thieves take the top */
+struct wq_deque {
+    pthread_mutex_t lock;
+    struct wq_task **slots;
+    size_t cap;
+    size_t top;
+    size_t bottom;
+};
+
+struct wq_worker {
+    struct workq *wq;
+    int id;
+    pthread_t thread;
+    unsigned int seed;
+    struct wq_deque dq;
+    char *scratch;              /* Private buffer of wq->scratch_size */
+};
+
+struct workq {
+    int nworkers;
+    struct wq_worker *workers;
+    size_t scratch_size;
+    size_t pending;             /* Tasks queued or running */
+    size_t nidle;
+    uint64_t gen;               /* Bumped on every push seen by sleepers */
+    unsigned int nerrors;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cv;
+};
+
+int workq_init(struct workq *wq, int nworkers, size_t scratch_size);
+void workq_submit(struct workq *wq, struct wq_task *task);
+void workq_submit_runs(struct workq *wq, struct wq_task **tasks, size_t n);
+void workq_push(struct wq_worker *w, struct wq_task *task);
+void workq_error(struct wq_worker *w);
+int workq_run(struct workq *wq);
+void workq_destroy(struct workq *wq);
+
+#endif  /* WORKQ_H */
@@ -0,0 +1,585 @@
+/*
+ * Copyright (c) 2023-2024 Ian Marco Moffett and the Osmora team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Osmora nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Batch processing of many files on the work-stealing scheduler.
+ *
+ * Each path starts as one file task (directories, with -R, as a walk
+ * task that produces file tasks; see walk.c). Small files are done by that
+ * task alone; files above BATCH_SPLIT are opened once and split into
+ * BATCH_CHUNK sized chunk tasks sharing the fd, which idle workers
+ * steal. Everything is inverted in place with pread()/pwrite()
+ * through the worker's scratch buffer, so memory use does not grow
+ * with file size.
+ *
+ * The paths are first sorted into on-disk order (see order.c) and
+ * each worker is dealt a contiguous run of them, so reads are mostly
+ * sequential until stealing starts at the end.
+ *
+ * Sparse files only have their data extents read and written (see
+ * sparse.c).
+ *
+ * Inverting is its own inverse, so a file must not be reached twice:
+ * every directory walked, every explicit path and every walked file
+ * with more than one link (or every walked file, when explicit files
+ * were given next to directories) is looked up by (st_dev, st_ino)
+ * in a shared set first, and skipped if it was already seen.
+ *
+ * With a manifest (see manifest.c) files left untouched since the
+ * last run are skipped, and everything we write is recorded with the
+ * hash of its new contents, computed from the chunks as they go out.
+ */
+
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <encrypt.h>
+#include <fileio.h>
+#include <inplace.h>
+#include <stats.h>
+#include <workq.h>
+#include <hash.h>
+#include <manifest.h>
+#include <sparse.h>
+#include <blkdev.h>
+#include <order.h>
+#include <copy.h>
+#include <batch.h>
+
+_Static_assert(BATCH_CHUNK == HASH_CHUNK, "chunk hashes must line up");
+
+#define SEEN_INITIAL    256
+
+struct seen_key {
+    uint64_t dev;
+    uint64_t ino;
+};
+
+/* A split file, shared by its chunk tasks */
+struct batch_file {
+    char *path;
+    int fd;
+    size_t refs;            /* Chunk tasks still outstanding */
+    int error;
+    size_t size;
+    bool sparse;            /* Has holes to skip */
+    uint64_t hash;          /* Sum of chunk hashes, for the manifest */
+};
+
+static const struct batch_opts *opts;
+
+/* Explicit files sit next to walked trees; check every walked file */
+static bool seen_all;
+
+/* Files and directories already reached, see batch_seen() */
+static struct {
+    struct seen_key *slots;     /* ino 0 marks a free slot */
+    size_t cap;                 /* Power of two */
+    size_t count;
+    pthread_mutex_t lock;
+} seen = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static size_t
+seen_slot(const struct seen_key *key, size_t cap)
+{
+    size_t i = hash64(key, sizeof(*key), 0) & (cap - 1);
+
+    while (seen.slots[i].ino != 0 &&
+           (seen.slots[i].dev != key->dev || seen.slots[i].ino != key->ino)) {
+        i = (i + 1) & (cap - 1);
+    }
+
+    return i;
+}
+
+static int
+seen_grow(void)
+{
+    struct seen_key *old = seen.slots;
+    size_t old_cap = seen.cap;
+
+    seen.cap = (old_cap == 0) ? SEEN_INITIAL : old_cap * 2;
+    if ((seen.slots = calloc(seen.cap, sizeof(*seen.slots))) == NULL) {
+        seen.slots = old;
+        seen.cap = old_cap;
+        return -1;
+    }
+
+    for (size_t i = 0; i < old_cap; ++i) {
+        if (old[i].ino != 0) {
+            seen.slots[seen_slot(&old[i], seen.cap)] = old[i];
+        }
+    }
+
+    free(old);
+    return 0;
+}
+
+/*
+ * Note the file or directory `st' as reached. Returns true if it
+ * already was, in which case it must be skipped. Should the set run
+ * out of memory the entry counts as new.
+ */
+bool
+batch_seen(const struct stat *st)
+{
+    struct seen_key key = { st->st_dev, st->st_ino };
+    bool found = false;
+    size_t i;
+
+    /* No real file has inode 0; don't let it alias a free slot */
+    if (key.ino == 0) {
+        return false;
+    }
+
+    pthread_mutex_lock(&seen.lock);
+    if ((seen.count + 1) * 10 > seen.cap * 7 && seen_grow() != 0) {
+        pthread_mutex_unlock(&seen.lock);
+        return false;
+    }
+
+    i = seen_slot(&key, seen.cap);
+    if (seen.slots[i].ino != 0) {
+        found = true;
+    } else {
+        seen.slots[i] = key;
+        ++seen.count;
+    }
+    pthread_mutex_unlock(&seen.lock);
+    return found;
+}
+
+/*
+ * Invert `len' bytes of `fd' at `off' through `buf' (BATCH_CHUNK
+ * bytes), in place. If `hash' is not NULL the hashes of the written
+ * chunks are added to it. With `sparse' set, chunks that are all
+ * hole are skipped and only the data extents of the others written.
+ */
+static int
+invert_range_fd(int fd, char *buf, off_t off, size_t len, bool sparse,
+                bool smooth, uint64_t *hash)
+{
+    off_t data, data_end;
+    struct io_stream ios;
+    size_t n;
+    uint64_t start;
+    int r;
+
+    io_stream_init(&ios, fd, off, len, smooth);
+    for (; len > 0; off += n, len -= n) {
+        n = (len > BATCH_CHUNK) ? BATCH_CHUNK : len;
+
+        if (sparse) {
+            r = sparse_next_data(fd, off, off + n, &data, &data_end);
+            if (r < 0) {
+                return errno;
+            }
+            if (r == 0) {
+                if (hash != NULL) {
+                    memset(buf, 0, n);
+                    __atomic_add_fetch(hash, hash_chunk(buf, n, off),
+                                       __ATOMIC_RELAXED);
+                }
+                continue;
+            }
+        }
+
+        start = stats_begin();
+        if (pread_full(fd, buf, n, off) != (ssize_t)n) {
+            return (errno != 0) ? errno : EIO;
+        }
+        stats_end(STATS_READ, start, n);
+
+        if (sparse) {
+            if (sparse_invert_buf(opts->info, fd, buf, off, n, true) != 0) {
+                return errno;
+            }
+        } else {
+            encrypt_fixed(opts->info, buf, n);
+
+            start = stats_begin();
+            if (pwrite_full(fd, buf, n, off) != 0) {
+                return errno;
+            }
+            stats_end(STATS_WRITE, start, n);
+        }
+        io_stream_written(&ios, off, n);
+
+        if (hash != NULL) {
+            __atomic_add_fetch(hash, hash_chunk(buf, n, off), __ATOMIC_RELAXED);
+        }
+    }
+
+    io_stream_finish(&ios);
+    return 0;
+}
+
+/*
+ * Record a file we have just finished writing in the manifest.
+ */
+static void
+record_fd(const char *path, int fd, uint64_t hash)
+{
+    struct stat st;
+
+    if (manifest_active() && fstat(fd, &st) == 0) {
+        manifest_record(path, &st, hash);
+    }
+}
+
+static void
+file_put(struct wq_worker *w, struct batch_file *bf)
+{
+    if (__atomic_sub_fetch(&bf->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+
+    if (bf->error == 0) {
+        if (bf->sparse) {
+            sparse_mark(bf->fd, !sparse_marked(bf->fd));
+        }
+        record_fd(bf->path, bf->fd, bf->hash);
+    }
+    if (close(bf->fd) != 0 && bf->error == 0) {
+        bf->error = errno;
+    }
+    if (bf->error != 0) {
+        fprintf(stderr, "%s: %s\n", bf->path, strerror(bf->error));
+        workq_error(w);
+    }
+
+    free(bf->path);
+    free(bf);
+}
+
+static void
+chunk_task(struct wq_worker *w, struct wq_task *task)
+{
+    struct batch_file *bf = task->arg;
+    int error;
+
+    /*
+     * Chunks of a big file are only a chunk long each, so this just
+     * gets their writeback going early rather than pacing a stream.
+     */
+    error = invert_range_fd(bf->fd, w->scratch, task->off, task->len,
+                            bf->sparse, bf->size >= IO_SMOOTH_MIN,
+                            manifest_active() ? &bf->hash : NULL);
+    if (error != 0) {
+        /* First error wins */
+        __atomic_compare_exchange_n(&bf->error, &(int){ 0 }, error, false,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+
+    free(task);
+    file_put(w, bf);
+}
+
+/*
+ * Split an open file into chunk tasks on this worker's deque. They
+ * are pushed back to front so the owner pops them in file order
+ * while thieves take the far end.
+ */
+static void
+split_file(struct wq_worker *w, char *path, int fd, const struct stat *st)
+{
+    size_t size = st->st_size;
+    struct batch_file *bf;
+    struct wq_task *task;
+    size_t nchunks;
+
+    bf = malloc(sizeof(*bf));
+    if (bf == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(ENOMEM));
+        workq_error(w);
+        close(fd);
+        free(path);
+        return;
+    }
+
+    nchunks = (size + BATCH_CHUNK - 1) / BATCH_CHUNK;
+    bf->path = path;
+    bf->fd = fd;
+    bf->refs = nchunks;
+    bf->error = 0;
+    bf->size = size;
+    bf->sparse = sparse_file(st);
+    bf->hash = 0;
+
+    for (size_t i = nchunks; i-- > 0;) {
+        task = malloc(sizeof(*task));
+        if (task == NULL) {
+            bf->error = ENOMEM;
+            file_put(w, bf);
+            continue;
+        }
+        task->run = chunk_task;
+        task->arg = bf;
+        task->off = i * BATCH_CHUNK;
+        task->len = (i == nchunks - 1) ? size - task->off : BATCH_CHUNK;
+        workq_push(w, task);
+    }
+}
+
+/*
+ * After the atomic and resumable modes, which write through their own
+ * descriptors, re-read the result to record it.
+ */
+static void
+record_path(const char *path, char *buf)
+{
+    uint64_t hash;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        return;
+    }
+    if (hash_fd(fd, buf, &hash) == 0) {
+        record_fd(path, fd, hash);
+    }
+    close(fd);
+}
+
+static void
+do_file(struct wq_worker *w, char *path, bool explicit)
+{
+    uint64_t hash = 0;
+    struct stat st;
+    int fd, error;
+
+    if (is_sidecar(path)) {
+        fprintf(stderr, "%s: journal or temporary file, skipped\n", path);
+        free(path);
+        return;
+    }
+
+    /*
+     * A walked file with a single link can only be reached once per
+     * directory, and directories are deduplicated by the walker.
+     */
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+        (explicit || seen_all || st.st_nlink > 1) && batch_seen(&st)) {
+        free(path);
+        return;
+    }
+
+    if (manifest_active() && stat(path, &st) == 0 &&
+        manifest_unchanged(path, &st, w->scratch)) {
+        free(path);
+        return;
+    }
+
+    if (opts->atomic || opts->resumable) {
+        error = opts->atomic ? atomic_invert(opts->info, path, 1) :
+                inplace_resumable(opts->info, path);
+        if (error != 0) {
+            workq_error(w);
+        } else if (manifest_active()) {
+            record_path(path, w->scratch);
+        }
+        free(path);
+        return;
+    }
+
+    if ((fd = open(path, O_RDWR)) < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        workq_error(w);
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(path);
+        return;
+    }
+
+    if (S_ISBLK(st.st_mode)) {
+        /* Its own O_DIRECT descriptor; one worker's worth of threads */
+        close(fd);
+        if (blkdev_invert(opts->info, path, 1) != 0) {
+            workq_error(w);
+        }
+        free(path);
+        return;
+    }
+
+    if (!S_ISREG(st.st_mode)) {
+        fprintf(stderr, "%s: not a regular file, skipped\n", path);
+        close(fd);
+        free(path);
+        return;
+    }
+
+    if (sparse_check(fd, &st, path) != 0) {
+        workq_error(w);
+        close(fd);
+        free(path);
+        return;
+    }
+
+    if ((size_t)st.st_size > BATCH_SPLIT) {
+        split_file(w, path, fd, &st);
+        return;
+    }
+
+    if ((size_t)st.st_size <= INPLACE_SMALL_MAX && !sparse_file(&st)) {
+        error = inplace_small(opts->info, fd, path, st.st_size);
+        if (error == 0 && manifest_active()) {
+            /* Still in the page cache; cheaper than plumbing it through */
+            if ((error = hash_fd(fd, w->scratch, &hash)) != 0) {
+                fprintf(stderr, "%s: %s\n", path, strerror(errno));
+            }
+        }
+    } else {
+        error = invert_range_fd(fd, w->scratch, 0, st.st_size,
+                                sparse_file(&st), false,
+                                manifest_active() ? &hash : NULL);
+        if (error != 0) {
+            fprintf(stderr, "%s: %s\n", path, strerror(error));
+        }
+    }
+
+    if (error != 0) {
+        workq_error(w);
+    } else {
+        if (sparse_file(&st)) {
+            sparse_mark(fd, !sparse_marked(fd));
+        }
+        record_fd(path, fd, hash);
+    }
+    close(fd);
+    free(path);
+}
+
+static void
+file_task(struct wq_worker *w, struct wq_task *task)
+{
+    char *path = task->arg;
+
+    free(task);
+    do_file(w, path, false);
+}
+
+static void
+explicit_task(struct wq_worker *w, struct wq_task *task)
+{
+    char *path = task->arg;
+
+    free(task);
+    do_file(w, path, true);
+}
+
+/*
+ * Make a task that inverts the file `path' (which it takes
+ * ownership of), found by walking a directory.
+ */
+struct wq_task *
+batch_file_task(char *path)
+{
+    struct wq_task *task;
+
+    if ((task = malloc(sizeof(*task))) == NULL) {
+        return NULL;
+    }
+
+    task->run = file_task;
+    task->arg = path;
+    return task;
+}
+
+/*
+ * Invert every file in `paths' using opts->nthreads workers.
+ * Returns the number of files that failed, or -1.
+ */
+int
+batch_run(const struct batch_opts *bopts, char **paths, size_t npaths)
+{
+    struct workq wq;
+    struct wq_task *task, **tasks;
+    struct stat st;
+    char *path;
+    int nerrors;
+
+    opts = bopts;
+    if (opts->recursive) {
+        walk_init(opts->filter);
+    }
+
+    if ((tasks = calloc(npaths, sizeof(*tasks))) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+
+    if (workq_init(&wq, bopts->nthreads, BATCH_CHUNK) != 0) {
+        fprintf(stderr, "Failed to set up workers\n");
+        free(tasks);
+        return -1;
+    }
+
+    npaths = order_paths(paths, npaths);
+    seen_all = false;
+    for (size_t i = 0; i < npaths; ++i) {
+        task = NULL;
+        if ((path = strdup(paths[i])) != NULL) {
+            if (opts->recursive && stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+                task = walk_task(path);
+            } else if ((task = batch_file_task(path)) != NULL) {
+                task->run = explicit_task;
+                seen_all = opts->recursive;
+            }
+        }
+        if (task == NULL) {
+            fprintf(stderr, "Failed to queue %s\n", paths[i]);
+            free(path);
+            while (i-- > 0) {
+                free(tasks[i]->arg);
+                free(tasks[i]);
+            }
+            free(tasks);
+            workq_destroy(&wq);
+            return -1;
+        }
+        tasks[i] = task;
+    }
+
+    workq_submit_runs(&wq, tasks, npaths);
+    free(tasks);
+
+    nerrors = workq_run(&wq);
+    workq_destroy(&wq);
+
+    free(seen.slots);
+    seen.slots = NULL;
+    seen.cap = seen.count = 0;
+    return nerrors;
+}
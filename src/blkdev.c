@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2023-2024 Ian Marco Moffett and the Osmora team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Osmora nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Raw block devices (partitions, loop devices, whole disks).
+ *
+ * There is no filesystem in the way to size or cache them: the size
+ * comes from BLKGETSIZE64 and the device is rewritten in place with
+ * O_DIRECT by parallel workers over disjoint, chunk-aligned ranges,
+ * so obfuscating a disk neither fills nor thrashes the page cache.
+ *
+ * Before that the device is claimed with an O_EXCL open, which the
+ * kernel refuses with EBUSY while it is mounted or held by LVM, MD
+ * and the like, and which keeps anyone else from claiming it until
+ * we are done.
+ */
+
+#define _GNU_SOURCE
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <encrypt.h>
+#include <tune.h>
+#include <parallel.h>
+#include <blkdev.h>
+
+/*
+ * Size in bytes of the block device open on `fd'.
+ */
+int
+blkdev_size(int fd, off_t *size_out)
+{
+    uint64_t size;
+
+    if (ioctl(fd, BLKGETSIZE64, &size) != 0) {
+        return -1;
+    }
+
+    *size_out = size;
+    return 0;
+}
+
+/*
+ * Claim the block device `fname' for exclusive use. Returns a
+ * descriptor to keep open while it is rewritten, or -1 (errno set)
+ * with a message printed.
+ */
+int
+blkdev_claim(const char *fname)
+{
+    int fd, error;
+
+    if ((fd = open(fname, O_RDONLY | O_EXCL | O_CLOEXEC)) < 0) {
+        error = errno;
+        if (error == EBUSY) {
+            fprintf(stderr, "%s: device is mounted or in use, "
+                    "refusing to rewrite it\n", fname);
+        } else {
+            fprintf(stderr, "%s: %s\n", fname, strerror(error));
+        }
+        errno = error;
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * Invert the block device `fname' in place with `nthreads' workers.
+ */
+int
+blkdev_invert(const struct cpu_info *info, const char *fname, int nthreads)
+{
+    off_t size;
+    int fd, sector, oflags = O_DIRECT, error;
+
+    if ((fd = blkdev_claim(fname)) < 0) {
+        return -1;
+    }
+
+    if (blkdev_size(fd, &size) != 0 || ioctl(fd, BLKSSZGET, &sector) != 0) {
+        fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    /*
+     * Every transfer starts on a chunk boundary and the last one ends
+     * at the end of the device; both must sit on sector boundaries.
+     */
+    if (sector <= 0 || g_tune.chunk_size % ENCRYPT_PAGE != 0 ||
+        ENCRYPT_PAGE % sector != 0 || size % sector != 0) {
+        oflags = 0;
+    }
+
+    /* The workers' own opens are not exclusive, so our claim holds */
+    error = parallel_inplace(info, fname, size, nthreads, oflags);
+    close(fd);
+    return error;
+}
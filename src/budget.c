@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2023-2024 Ian Marco Moffett and the Osmora team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Osmora nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Memory budget (--max-mem).
+ *
+ * Modes that stage a whole file in memory (atomic replacement, and
+ * single-threaded in-place rewrites) ask here before allocating it.
+ * A file that could never fit in the budget is streamed in chunks
+ * instead (see budget_fits()); one that could but does not fit right
+ * now waits in budget_acquire() until other workers give memory back.
+ * Buffers that live for the whole run, like each worker's chunk
+ * buffer, are taken off the top once with budget_reserve().
+ *
+ * Without a limit every call is a no-op and everything fits.
+ */
+
+#include <pthread.h>
+#include <budget.h>
+
+static size_t limit;            /* 0 if unlimited */
+static size_t reserved;
+static size_t used;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t freed = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Limit what is handed out to `limit' bytes (0 for no limit). Call
+ * before any workers are started.
+ */
+void
+budget_init(size_t lim)
+{
+    limit = lim;
+    reserved = 0;
+    used = 0;
+}
+
+/*
+ * Take `n' bytes off the budget for good.
+ */
+void
+budget_reserve(size_t n)
+{
+    pthread_mutex_lock(&lock);
+    reserved += n;
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Whether `n' bytes can ever be granted, i.e. fit in what is left
+ * after the reservations.
+ */
+bool
+budget_fits(size_t n)
+{
+    bool fits;
+
+    if (limit == 0) {
+        return true;
+    }
+
+    pthread_mutex_lock(&lock);
+    fits = reserved < limit && n <= limit - reserved;
+    pthread_mutex_unlock(&lock);
+    return fits;
+}
+
+/*
+ * Wait until `n' bytes are free and take them. `n' must fit (see
+ * budget_fits()), or this never returns.
+ */
+void
+budget_acquire(size_t n)
+{
+    if (limit == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    while (reserved + used + n > limit) {
+        pthread_cond_wait(&freed, &lock);
+    }
+    used += n;
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Give back `n' bytes taken with budget_acquire().
+ */
+void
+budget_release(size_t n)
+{
+    if (limit == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    used -= n;
+    pthread_cond_broadcast(&freed);
+    pthread_mutex_unlock(&lock);
+}
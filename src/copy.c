@@ -0,0 +1,307 @@
+/*
+ * Copyright (c) 2023-2024 Ian Marco Moffett and the Osmora team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Osmora nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Destination copy mode (-o): write the inverted contents of a file
+ * to a new file, leaving the source alone.
+ *
+ * On CoW filesystems (btrfs, XFS with reflink) the destination is
+ * first cloned from the source with FICLONE, which shares every
+ * extent and costs no I/O, and then inverted in place. Inversion
+ * changes every data byte, so each data extent is still rewritten
+ * once, but there is no separate copy pass, holes stay shared and
+ * unallocated, and the source's blocks are never duplicated only to
+ * be overwritten. Elsewhere the source is streamed through the
+ * kernels straight into the destination, again writing each data
+ * byte exactly once.
+ *
+ * Atomic replacement (-a) is the same copy with a temporary next to
+ * the file as the destination (see atomic_open()). Files that fit in
+ * the memory budget (see budget.c) are staged in memory and inverted
+ * there; larger ones are streamed through the temporary.
+ */
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <encrypt.h>
+#include <fileio.h>
+#include <sparse.h>
+#include <stats.h>
+#include <parallel.h>
+#include <budget.h>
+#include <copy.h>
+
+/*
+ * Read [off, off + len) from `rfd', invert it and write it to the
+ * same range of `wfd' (which may be `rfd'), SPARSE_CHUNK at a time.
+ */
+static int
+invert_range(const struct cpu_info *info, int rfd, int wfd, char *buf,
+             off_t off, off_t len)
+{
+    struct io_stream in, out;
+    bool smooth = len >= (off_t)IO_SMOOTH_MIN;
+    size_t n;
+    uint64_t start;
+
+    io_stream_init(&in, rfd, off, len, smooth && rfd != wfd);
+    io_stream_init(&out, wfd, off, len, smooth);
+
+    for (; len > 0; off += n, len -= n) {
+        n = (len > (off_t)SPARSE_CHUNK) ? SPARSE_CHUNK : (size_t)len;
+
+        start = stats_begin();
+        if (pread_full(rfd, buf, n, off) != (ssize_t)n) {
+            if (errno == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        stats_end(STATS_READ, start, n);
+        io_stream_read(&in, off, n);
+
+        encrypt_fixed(info, buf, n);
+
+        start = stats_begin();
+        if (pwrite_full(wfd, buf, n, off) != 0) {
+            return -1;
+        }
+        io_stream_written(&out, off, n);
+        stats_end(STATS_WRITE, start, n);
+    }
+
+    io_stream_finish(&out);
+    return 0;
+}
+
+/*
+ * Invert every data extent of `rfd' (all of it unless `sparse') into
+ * `wfd'.
+ */
+static int
+invert_extents(const struct cpu_info *info, int rfd, int wfd, off_t size,
+               bool sparse)
+{
+    off_t pos = 0, data, data_end;
+    char *buf;
+    int r;
+
+    if ((buf = malloc(SPARSE_CHUNK)) == NULL) {
+        return -1;
+    }
+
+    if (!sparse) {
+        r = invert_range(info, rfd, wfd, buf, 0, size);
+        free(buf);
+        return r;
+    }
+
+    while ((r = sparse_next_data(rfd, pos, size, &data, &data_end)) > 0) {
+        if (invert_range(info, rfd, wfd, buf, data, data_end - data) != 0) {
+            r = -1;
+            break;
+        }
+        pos = data_end;
+    }
+
+    free(buf);
+    return r;
+}
+
+/*
+ * Write the inverse of `src' to `dst', creating or replacing it.
+ */
+int
+copy_invert(const struct cpu_info *info, const char *src, const char *dst)
+{
+    struct stat st, dst_st;
+    bool cloned = false;
+    int sfd, dfd, error = -1;
+
+    if ((sfd = open(src, O_RDONLY)) < 0 || fstat(sfd, &st) != 0) {
+        fprintf(stderr, "%s: %s\n", src, strerror(errno));
+        if (sfd >= 0) {
+            close(sfd);
+        }
+        return -1;
+    }
+
+    if (!S_ISREG(st.st_mode)) {
+        fprintf(stderr, "%s: not a regular file\n", src);
+        close(sfd);
+        return -1;
+    }
+
+    if (sparse_check(sfd, &st, src) != 0) {
+        close(sfd);
+        return -1;
+    }
+
+    if (stat(dst, &dst_st) == 0 && dst_st.st_dev == st.st_dev &&
+        dst_st.st_ino == st.st_ino) {
+        fprintf(stderr, "%s: same file as %s\n", dst, src);
+        close(sfd);
+        return -1;
+    }
+
+    dfd = open(dst, O_RDWR | O_CREAT | O_TRUNC, st.st_mode & 07777);
+    if (dfd < 0) {
+        fprintf(stderr, "%s: %s\n", dst, strerror(errno));
+        close(sfd);
+        return -1;
+    }
+
+#if defined(FICLONE)
+    /* Fails with EXDEV, EOPNOTSUPP or EINVAL where extents can't be shared */
+    cloned = ioctl(dfd, FICLONE, sfd) == 0;
+#endif  /* defined(FICLONE) */
+
+    if (cloned) {
+        error = invert_extents(info, dfd, dfd, st.st_size, sparse_file(&st));
+    } else {
+        error = invert_extents(info, sfd, dfd, st.st_size, sparse_file(&st));
+        if (error == 0) {
+            /* Trailing hole */
+            error = ftruncate(dfd, st.st_size);
+        }
+    }
+
+    if (error != 0) {
+        fprintf(stderr, "%s: %s\n", dst, strerror(errno));
+    } else {
+        /* O_TRUNC keeps xattrs, so set or clear the tag either way */
+        sparse_mark(dfd, sparse_file(&st) && !sparse_marked(sfd));
+    }
+
+    if (close(dfd) != 0 && error == 0) {
+        fprintf(stderr, "%s: %s\n", dst, strerror(errno));
+        error = -1;
+    }
+    close(sfd);
+    return error;
+}
+
+/*
+ * Replace `fname' by its inverse through a temporary written a chunk
+ * at a time.
+ */
+static int
+stream_atomic(const struct cpu_info *info, const char *fname)
+{
+    struct atomic_tmp at;
+    int fd, error;
+
+    if ((fd = open(fname, O_RDONLY)) < 0) {
+        fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+        return -1;
+    }
+
+    if (atomic_open(&at, fname) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    error = invert_extents(info, fd, at.fd, at.st.st_size,
+                           sparse_file(&at.st));
+    if (error == 0) {
+        /* Trailing hole */
+        error = ftruncate(at.fd, at.st.st_size);
+    }
+    close(fd);
+
+    if (error != 0) {
+        fprintf(stderr, "%s: write failed: %s\n", at.dir, strerror(errno));
+        atomic_abort(&at);
+        return -1;
+    }
+
+    return atomic_commit(&at, fname);
+}
+
+/*
+ * Atomically replace `fname' by its inverse, with `nthreads' threads
+ * if it is staged in memory. Waits for room in the memory budget if
+ * need be.
+ */
+int
+atomic_invert(const struct cpu_info *info, const char *fname, int nthreads)
+{
+    struct stat st;
+    size_t size;
+    uint64_t start;
+    char *buf;
+    int error = -1;
+
+    if (stat(fname, &st) != 0) {
+        fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+        return -1;
+    }
+
+    if (!budget_fits(st.st_size)) {
+        return stream_atomic(info, fname);
+    }
+
+    /* What we read is capped to what we took, should the file grow */
+    budget_acquire(st.st_size);
+    if (nthreads > 1 && !sparse_file(&st)) {
+        /* Workers read and invert their own slices, NUMA-locally */
+        buf = parallel_load(info, fname, st.st_size, &size, nthreads);
+    } else {
+        start = stats_begin();
+        if ((buf = read_file(fname, st.st_size, &size)) != NULL) {
+            stats_end(STATS_READ, start, size);
+            if (sparse_encrypt(info, fname, buf, size) != 0) {
+                free(buf);
+                buf = NULL;
+            }
+        }
+    }
+    if (buf == NULL && errno == EFBIG) {
+        budget_release(st.st_size);
+        return stream_atomic(info, fname);
+    }
+
+    if (buf != NULL) {
+        start = stats_begin();
+        error = writeback_atomic(fname, buf, size);
+        stats_end(STATS_WRITE, start, size);
+        free(buf);
+    }
+    budget_release(st.st_size);
+    return error;
+}
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2023-2024 Ian Marco Moffett and the Osmora team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Osmora nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <info.h>
+
+#if defined(__x86_64__)
+#define cpuid(level, a, b, c, d)					\
+  __asm__ __volatile__ ("cpuid\n\t"					\
+			: "=a" (a), "=b" (b), "=c" (c), "=d" (d)	\
+			: "0" (level))
+
+#define cpuid_count(level, count, a, b, c, d)				\
+  __asm__ __volatile__ ("cpuid\n\t"					\
+			: "=a" (a), "=b" (b), "=c" (c), "=d" (d)	\
+			: "0" (level), "2" (count))
+
+#define CPUID1_ECX_SSE3     (1 << 0)
+#define CPUID1_ECX_OSXSAVE  (1 << 27)
+#define CPUID1_ECX_AVX      (1 << 28)
+#define CPUID1_EDX_SSE2     (1 << 26)
+#define CPUID7_EBX_AVX2     (1 << 5)
+#define CPUID7_EBX_AVX512F  (1 << 16)
+#define CPUID7_EBX_AVX512BW (1 << 30)
+
+#define XCR0_SSE            (1 << 1)
+#define XCR0_AVX            (1 << 2)
+#define XCR0_AVX512         (7 << 5)    /* Opmask, ZMM_Hi256, Hi16_ZMM */
+#endif  /* defined(__x86_64__) */
+
+static struct cpu_info cached_info;
+static bool cached;
+
+#if defined(__x86_64__)
+static inline uint64_t
+xgetbv(uint32_t index)
+{
+    uint32_t eax, edx;
+
+    __asm__ __volatile__ ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (index));
+    return ((uint64_t)edx << 32) | eax;
+}
+
+/*
+ * One pass over CPUID leaves 1 and 7 answers every feature we care
+ * about. The AVX levels additionally need the OS to save the wider
+ * register state.
+ */
+static void
+amd64_cpu_tests(struct cpu_info *info)
+{
+    uint32_t max_leaf, ebx, ecx, edx, unused;
+    uint64_t xcr0;
+
+    cpuid(0x0000000, max_leaf, unused, unused, unused);
+    cpuid(0x0000001, unused, unused, ecx, edx);
+
+    info->has_sse2 = (edx & CPUID1_EDX_SSE2) != 0;
+    info->has_sse3 = (ecx & CPUID1_ECX_SSE3) != 0;
+
+    if (!(ecx & CPUID1_ECX_AVX) || !(ecx & CPUID1_ECX_OSXSAVE)) {
+        return;
+    }
+
+    xcr0 = xgetbv(0);
+    if ((xcr0 & (XCR0_SSE | XCR0_AVX)) != (XCR0_SSE | XCR0_AVX)) {
+        return;
+    }
+
+    info->has_avx = 1;
+    if (max_leaf < 7) {
+        return;
+    }
+
+    cpuid_count(0x0000007, 0, unused, ebx, unused, unused);
+    info->has_avx2 = (ebx & CPUID7_EBX_AVX2) != 0;
+    info->has_avx512 = (ebx & CPUID7_EBX_AVX512F) &&
+                       (ebx & CPUID7_EBX_AVX512BW) &&
+                       (xcr0 & XCR0_AVX512) == XCR0_AVX512;
+}
+#endif  /* defined(__x86_64__) */
+
+/*
+ * Fill `info' with the features of this CPU. Detection runs once per
+ * process; later calls copy the cached result.
+ */
+void
+cpu_detect(struct cpu_info *info, bool verbose)
+{
+    if (!cached) {
+#if defined(__x86_64__)
+        amd64_cpu_tests(&cached_info);
+#endif  /* defined(__x86_64__) */
+        cached = true;
+    }
+
+    *info = cached_info;
+
+    if (!verbose) {
+        return;
+    }
+
+    if (info->has_sse3) {
+        fprintf(stderr, "[?]: SSE3 supported, may use as optimization\n");
+    } else if (info->has_sse2) {
+        fprintf(stderr, "[?]: SSE2 supported, may use as optimization\n");
+    }
+
+    if (info->has_avx) {
+        fprintf(stderr, "[?]: AVX supported, may use as optimization\n");
+    }
+
+    if (info->has_avx2) {
+        fprintf(stderr, "[?]: AVX2 supported, may use as optimization\n");
+    }
+
+    if (info->has_avx512) {
+        fprintf(stderr, "[?]: AVX-512 supported, may use as optimization\n");
+    }
+}
@@ -0,0 +1,857 @@
+/*
+ * Copyright (c) 2023-2024 Ian Marco Moffett and the Osmora team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Osmora nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Daemon mode.
+ *
+ * Starting the binary per job pays for exec, dynamic linking, CPU
+ * detection and profile loading every time. `--daemon SOCKET' does
+ * all of that once and then serves requests on a Unix socket from a
+ * fixed pool of threads, each with a chunk buffer allocated up front,
+ * so a request costs a recvmsg(), the I/O and a sendmsg().
+ *
+ * The main thread watches the listening socket and every idle
+ * connection with epoll. A connection with a request waiting is
+ * queued for the pool; a worker serves that one request and hands
+ * the connection back, so idle clients hold no worker and requests
+ * on one connection are still served in order. Clients
+ * should pass an open descriptor (SCM_RIGHTS) rather than a path
+ * where they can: then the file is accessed with the client's
+ * rights, not the daemon's. The socket itself is created mode 0600.
+ *
+ * A connection may instead attach a shared-memory ring (see
+ * shmring.c), after which its worker serves that ring until the
+ * client is done with it. Rings may take all workers but one.
+ *
+ * SIGINT and SIGTERM are blocked everywhere but in the main thread's
+ * epoll_pwait(). On either we stop accepting, let requests being
+ * served finish (a ring stops once it is idle), answer requests still
+ * waiting with ESHUTDOWN and join the workers, so no file is left
+ * half inverted.
+ */
+
+#define _GNU_SOURCE
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <encrypt.h>
+#include <fileio.h>
+#include <inplace.h>
+#include <sparse.h>
+#include <blkdev.h>
+#include <copy.h>
+#include <stats.h>
+#include <daemon.h>
+#include <shmring.h>
+
+/* Connections accepted but not yet picked up by a worker */
+#define DAEMON_BACKLOG  64
+
+/* Events taken per epoll_pwait() */
+#define DAEMON_EVENTS   64
+
+/* Bounds of the pause after accept() runs out of descriptors */
+#define DAEMON_BACKOFF_MIN_MS   10
+#define DAEMON_BACKOFF_MAX_MS   1000
+
+struct pool_worker {
+    pthread_t thread;
+    char *buf;                  /* DAEMON_CHUNK bytes */
+    int sock;                   /* Connection being served, or -1 */
+};
+
+static struct {
+    const struct cpu_info *info;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;       /* Connection queued, or shutting down */
+    pthread_cond_t space;       /* Queue slot freed */
+    int queue[DAEMON_BACKLOG];  /* Connections with a request waiting */
+    size_t head;
+    size_t count;
+    bool shutdown;              /* Take no more connections */
+    int epfd;                   /* Idle connections */
+    int nrings;                 /* Workers held by shared rings */
+    struct pool_worker *workers;
+    int nworkers;
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .ready = PTHREAD_COND_INITIALIZER,
+    .space = PTHREAD_COND_INITIALIZER
+};
+
+static volatile sig_atomic_t stopping;
+
+static void
+on_signal(int sig)
+{
+    (void)sig;
+    stopping = 1;
+}
+
+/*
+ * Invert [off, off + len) of `fd' through `buf' (DAEMON_CHUNK bytes).
+ * Returns 0 or an errno value.
+ */
+static int
+invert_range(int fd, const struct stat *st, char *buf, off_t off, off_t len)
+{
+    bool sparse = sparse_file(st);
+    uint64_t start;
+    size_t n;
+
+    for (; len > 0; off += n, len -= n) {
+        n = (len > (off_t)DAEMON_CHUNK) ? DAEMON_CHUNK : (size_t)len;
+
+        start = stats_begin();
+        if (pread_full(fd, buf, n, off) != (ssize_t)n) {
+            return (errno != 0) ? errno : EIO;
+        }
+        stats_end(STATS_READ, start, n);
+
+        if (sparse) {
+            if (sparse_invert_buf(pool.info, fd, buf, off, n, true) != 0) {
+                return errno;
+            }
+            continue;
+        }
+
+        encrypt_fixed(pool.info, buf, n);
+
+        start = stats_begin();
+        if (pwrite_full(fd, buf, n, off) != 0) {
+            return errno;
+        }
+        stats_end(STATS_WRITE, start, n);
+    }
+
+    return 0;
+}
+
+/*
+ * Carry out one request on `fd' (passed by the client, or -1).
+ * Returns 0 or an errno value.
+ */
+static int
+serve_req(const struct daemon_req *req, int fd, char *buf, uint64_t *bytes)
+{
+    char claim_path[sizeof("/proc/self/fd/") + 3 * sizeof(int)];
+    struct stat st;
+    off_t size, end;
+    bool own = false;
+    int error, claim = -1;
+
+    switch (req->mode) {
+    case DAEMON_MODE_INPLACE:
+        break;
+    case DAEMON_MODE_ATOMIC:
+    case DAEMON_MODE_RESUMABLE:
+        /* These rename or journal next to the file, so need its name */
+        if (fd >= 0 || req->path[0] == '\0') {
+            return EINVAL;
+        }
+        if (stat(req->path, &st) != 0) {
+            return errno;
+        }
+        error = (req->mode == DAEMON_MODE_ATOMIC) ? atomic_invert(pool.info, req->path, 1) :
+            inplace_resumable(pool.info, req->path);
+        if (error != 0) {
+            /* The details went to our stderr */
+            return EIO;
+        }
+        *bytes = st.st_size;
+        return 0;
+    default:
+        return EINVAL;
+    }
+
+    if (fd < 0) {
+        if (req->path[0] == '\0') {
+            return EINVAL;
+        }
+        if ((fd = open(req->path, O_RDWR)) < 0) {
+            return errno;
+        }
+        own = true;
+    }
+
+    if (fstat(fd, &st) != 0) {
+        error = errno;
+        goto done;
+    }
+
+    if (S_ISREG(st.st_mode)) {
+        if (sparse_check(fd, &st, req->path[0] != '\0' ? req->path :
+                         "(passed descriptor)") != 0) {
+            error = EINVAL;
+            goto done;
+        }
+        size = st.st_size;
+    } else if (S_ISBLK(st.st_mode)) {
+        /* Reopen through /proc to claim it; busy devices get EBUSY */
+        snprintf(claim_path, sizeof(claim_path), "/proc/self/fd/%d", fd);
+        if ((claim = blkdev_claim(claim_path)) < 0) {
+            error = errno;
+            goto done;
+        }
+        if (blkdev_size(fd, &size) != 0) {
+            error = errno;
+            goto done;
+        }
+    } else {
+        error = EINVAL;
+        goto done;
+    }
+
+    if (req->off > (uint64_t)size) {
+        error = EINVAL;
+        goto done;
+    }
+    end = (req->len == 0 || req->len > (uint64_t)(size - req->off)) ?
+        size : (off_t)(req->off + req->len);
+
+    error = invert_range(fd, &st, buf, req->off, end - req->off);
+    if (error == 0) {
+        if (req->off == 0 && end == size && sparse_file(&st)) {
+            sparse_mark(fd, !sparse_marked(fd));
+        }
+        *bytes = end - req->off;
+    }
+done:
+    if (claim >= 0) {
+        close(claim);
+    }
+    if (own) {
+        close(fd);
+    }
+    return error;
+}
+
+/*
+ * Receive one request and the descriptor passed with it, if any.
+ * Returns the packet length, 0 on hangup or -1.
+ */
+static ssize_t
+recv_req(int sock, struct daemon_req *req, int *fd_out)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctl;
+    struct iovec iov = { req, sizeof(*req) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = ctl.buf,
+        .msg_controllen = sizeof(ctl.buf)
+    };
+    struct cmsghdr *cmsg;
+    ssize_t n;
+
+    *fd_out = -1;
+    do {
+        n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+
+    if (n <= 0) {
+        return n;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+            memcpy(fd_out, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+
+    return n;
+}
+
+/*
+ * Attach the ring on `memfd' and serve it until the client is done,
+ * unless rings already hold all the workers we can spare.
+ */
+static void
+serve_ring(int memfd, int sock)
+{
+    struct daemon_reply reply = { .magic = DAEMON_MAGIC, .error = EBUSY };
+    bool room;
+
+    pthread_mutex_lock(&pool.lock);
+    room = pool.nrings < ((pool.nworkers > 1) ? pool.nworkers - 1 : 1);
+    if (room) {
+        ++pool.nrings;
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    if (!room) {
+        send(sock, &reply, sizeof(reply), MSG_NOSIGNAL);
+        return;
+    }
+
+    /* Replies for itself */
+    shmring_serve(pool.info, memfd, sock);
+
+    pthread_mutex_lock(&pool.lock);
+    --pool.nrings;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/*
+ * Serve the next request on `sock'. Returns 0 if the connection
+ * stays open, -1 once the client has hung up or can't be answered.
+ */
+static int
+serve_one(int sock, char *buf)
+{
+    struct daemon_req req;
+    struct daemon_reply reply;
+    uint64_t start;
+    ssize_t n;
+    int fd;
+
+    if ((n = recv_req(sock, &req, &fd)) <= 0) {
+        return -1;
+    }
+
+    start = stats_now();
+    reply.magic = DAEMON_MAGIC;
+    reply.bytes = 0;
+
+    if ((size_t)n < offsetof(struct daemon_req, path) ||
+        req.magic != DAEMON_MAGIC) {
+        reply.error = EPROTO;
+    } else {
+        /* Terminate whatever made it into the packet */
+        if ((size_t)n < sizeof(req)) {
+            req.path[n - offsetof(struct daemon_req, path)] = '\0';
+        }
+        req.path[DAEMON_PATH_MAX - 1] = '\0';
+
+        if (req.mode == DAEMON_MODE_SHM && fd >= 0) {
+            serve_ring(fd, sock);
+            close(fd);
+            return 0;
+        }
+        reply.error = serve_req(&req, fd, buf, &reply.bytes);
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    reply.nsec = stats_now() - start;
+    return (send(sock, &reply, sizeof(reply), MSG_NOSIGNAL) < 0) ? -1 : 0;
+}
+
+/*
+ * Have the main thread watch `sock' for its next request.
+ */
+static int
+conn_watch(int sock, int op)
+{
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT,
+        .data.fd = sock
+    };
+
+    return epoll_ctl(pool.epfd, op, sock, &ev);
+}
+
+/*
+ * Turn away a connection we will not serve: every request it has
+ * already sent is answered with ESHUTDOWN, then it is closed.
+ */
+static void
+reject_conn(int sock)
+{
+    struct daemon_req req;
+    struct daemon_reply reply = {
+        .magic = DAEMON_MAGIC,
+        .error = ESHUTDOWN
+    };
+    int fd;
+
+    /* Queued packets are still delivered, then recv returns 0 */
+    shutdown(sock, SHUT_RD);
+    while (recv_req(sock, &req, &fd) > 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (send(sock, &reply, sizeof(reply), MSG_NOSIGNAL) < 0) {
+            break;
+        }
+    }
+    close(sock);
+}
+
+static void *
+pool_worker(void *arg)
+{
+    struct pool_worker *w = arg;
+    bool keep, stop;
+    int sock;
+
+    for (;;) {
+        pthread_mutex_lock(&pool.lock);
+        while (pool.count == 0 && !pool.shutdown) {
+            pthread_cond_wait(&pool.ready, &pool.lock);
+        }
+        if (pool.shutdown) {
+            /* Whatever is still queued is rejected by daemon_serve() */
+            pthread_mutex_unlock(&pool.lock);
+            break;
+        }
+        sock = pool.queue[pool.head];
+        pool.head = (pool.head + 1) % DAEMON_BACKLOG;
+        --pool.count;
+        w->sock = sock;
+        pthread_cond_signal(&pool.space);
+        pthread_mutex_unlock(&pool.lock);
+
+        keep = serve_one(sock, w->buf) == 0;
+
+        /* Unpublish before close() so the number is not reused under us */
+        pthread_mutex_lock(&pool.lock);
+        w->sock = -1;
+        stop = pool.shutdown;
+        pthread_mutex_unlock(&pool.lock);
+
+        if (keep && stop) {
+            reject_conn(sock);
+        } else if (!keep || conn_watch(sock, EPOLL_CTL_MOD) != 0) {
+            close(sock);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Stop the pool: let in-flight requests finish, reject queued
+ * connections and wait for every worker to exit.
+ */
+static void
+pool_stop(void)
+{
+    int sock;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.shutdown = true;
+    pthread_cond_broadcast(&pool.ready);
+    pthread_cond_broadcast(&pool.space);
+
+    /*
+     * The request being served finishes and later ones on the same
+     * connection are rejected; a shared ring sees the hangup and
+     * stops once it is idle.
+     */
+    for (int i = 0; i < pool.nworkers; ++i) {
+        if (pool.workers[i].sock >= 0) {
+            shutdown(pool.workers[i].sock, SHUT_RD);
+        }
+    }
+
+    while (pool.count > 0) {
+        sock = pool.queue[pool.head];
+        pool.head = (pool.head + 1) % DAEMON_BACKLOG;
+        --pool.count;
+        pthread_mutex_unlock(&pool.lock);
+        reject_conn(sock);
+        pthread_mutex_lock(&pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    for (int i = 0; i < pool.nworkers; ++i) {
+        pthread_join(pool.workers[i].thread, NULL);
+        free(pool.workers[i].buf);
+    }
+    free(pool.workers);
+    pool.workers = NULL;
+    pool.nworkers = 0;
+}
+
+/*
+ * accept() failed for lack of descriptors or memory: wait for some
+ * to be released instead of spinning on the error.
+ */
+static void
+accept_backoff(int *delay_ms)
+{
+    struct timespec ts;
+
+    if (*delay_ms == 0) {
+        fprintf(stderr, "accept: %s, backing off\n", strerror(errno));
+        *delay_ms = DAEMON_BACKOFF_MIN_MS;
+    } else if (*delay_ms < DAEMON_BACKOFF_MAX_MS) {
+        *delay_ms *= 2;
+    }
+
+    ts.tv_sec = *delay_ms / 1000;
+    ts.tv_nsec = (*delay_ms % 1000) * 1000000L;
+    nanosleep(&ts, NULL);
+}
+
+/*
+ * Queue `sock', which has a request waiting, for the pool.
+ */
+static void
+queue_conn(int sock)
+{
+    pthread_mutex_lock(&pool.lock);
+    while (pool.count == DAEMON_BACKLOG) {
+        pthread_cond_wait(&pool.space, &pool.lock);
+    }
+    pool.queue[(pool.head + pool.count) % DAEMON_BACKLOG] = sock;
+    ++pool.count;
+    pthread_cond_signal(&pool.ready);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/*
+ * Accept one connection on `lsock' and start watching it. Returns -1
+ * on an error that ends the daemon.
+ */
+static int
+accept_conn(int lsock, int *delay_ms)
+{
+    int sock;
+
+    sock = accept4(lsock, NULL, NULL, SOCK_CLOEXEC);
+    if (sock < 0) {
+        switch (errno) {
+        case EINTR:
+        case EAGAIN:
+        case ECONNABORTED:
+            return 0;
+        case EMFILE:
+        case ENFILE:
+        case ENOBUFS:
+        case ENOMEM:
+            accept_backoff(delay_ms);
+            return 0;
+        default:
+            fprintf(stderr, "accept: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    *delay_ms = 0;
+
+    if (conn_watch(sock, EPOLL_CTL_ADD) != 0) {
+        fprintf(stderr, "epoll: %s\n", strerror(errno));
+        close(sock);
+    }
+    return 0;
+}
+
+/*
+ * Bind `lsock' to `sock_path'. Only a socket may be replaced there
+ * (a stale one from an earlier run), and only if nothing answers on
+ * it; the socket is created 0600 from the start. Its inode is stored
+ * in `st' so we later remove only our own.
+ */
+static int
+bind_path(int lsock, const struct sockaddr_un *addr, const char *sock_path,
+          struct stat *st)
+{
+    mode_t mask;
+    int probe, error;
+
+    if (lstat(sock_path, st) == 0) {
+        if (!S_ISSOCK(st->st_mode)) {
+            fprintf(stderr, "%s: exists and is not a socket\n", sock_path);
+            return -1;
+        }
+
+        probe = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (probe >= 0 && connect(probe, (const struct sockaddr *)addr,
+                                  sizeof(*addr)) == 0) {
+            fprintf(stderr, "%s: a daemon is already listening\n",
+                    sock_path);
+            close(probe);
+            return -1;
+        }
+        if (probe >= 0) {
+            close(probe);
+        }
+        unlink(sock_path);
+    } else if (errno != ENOENT) {
+        fprintf(stderr, "%s: %s\n", sock_path, strerror(errno));
+        return -1;
+    }
+
+    mask = umask(077);
+    error = bind(lsock, (const struct sockaddr *)addr, sizeof(*addr));
+    umask(mask);
+
+    if (error != 0 || lstat(sock_path, st) != 0 ||
+        listen(lsock, DAEMON_BACKLOG) != 0) {
+        fprintf(stderr, "%s: %s\n", sock_path, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Remove our socket, unless something else has taken its place.
+ */
+static void
+unlink_path(const char *sock_path, const struct stat *ours)
+{
+    struct stat st;
+
+    if (lstat(sock_path, &st) == 0 && S_ISSOCK(st.st_mode) &&
+        st.st_dev == ours->st_dev && st.st_ino == ours->st_ino) {
+        unlink(sock_path);
+    }
+}
+
+/*
+ * Listen on `sock_path' and serve requests with `nthreads' workers
+ * until SIGINT or SIGTERM.
+ */
+int
+daemon_serve(const struct cpu_info *info, const char *sock_path, int nthreads)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct sigaction sa = { .sa_handler = on_signal };
+    struct epoll_event ev = { .events = EPOLLIN }, evs[DAEMON_EVENTS];
+    struct pool_worker *w;
+    struct stat sock_st;
+    sigset_t block, orig;
+    int lsock, n, delay_ms = 0, error = 0;
+
+    if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: %s\n", sock_path, strerror(ENAMETOOLONG));
+        return -1;
+    }
+    strcpy(addr.sun_path, sock_path);
+
+    pool.info = info;
+    lsock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (lsock < 0) {
+        fprintf(stderr, "socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (bind_path(lsock, &addr, sock_path, &sock_st) != 0) {
+        close(lsock);
+        return -1;
+    }
+
+    pool.epfd = epoll_create1(EPOLL_CLOEXEC);
+    ev.data.fd = lsock;
+    if (pool.epfd < 0 || epoll_ctl(pool.epfd, EPOLL_CTL_ADD, lsock, &ev) != 0) {
+        fprintf(stderr, "epoll: %s\n", strerror(errno));
+        if (pool.epfd >= 0) {
+            close(pool.epfd);
+        }
+        close(lsock);
+        unlink_path(sock_path, &sock_st);
+        return -1;
+    }
+
+    /*
+     * Block the stop signals before the workers exist so they inherit
+     * the mask; we only take them in epoll_pwait() below, which also
+     * closes the race between checking `stopping' and sleeping.
+     */
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &orig);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    /* The pool, each worker with its buffer, is set up once */
+    pool.workers = calloc(nthreads, sizeof(*pool.workers));
+    for (int i = 0; pool.workers != NULL && i < nthreads; ++i) {
+        w = &pool.workers[i];
+        w->sock = -1;
+        if (posix_memalign((void **)&w->buf, ENCRYPT_PAGE,
+                           DAEMON_CHUNK) != 0) {
+            break;
+        }
+        if (pthread_create(&w->thread, NULL, pool_worker, w) != 0) {
+            free(w->buf);
+            break;
+        }
+        ++pool.nworkers;
+    }
+
+    if (pool.nworkers == 0) {
+        fprintf(stderr, "Failed to start workers\n");
+        free(pool.workers);
+        pool.workers = NULL;
+        close(pool.epfd);
+        close(lsock);
+        unlink_path(sock_path, &sock_st);
+        pthread_sigmask(SIG_SETMASK, &orig, NULL);
+        return -1;
+    }
+
+    while (!stopping && error == 0) {
+        n = epoll_pwait(pool.epfd, evs, DAEMON_EVENTS, -1, &orig);
+        if (n < 0) {
+            if (errno != EINTR) {
+                fprintf(stderr, "epoll: %s\n", strerror(errno));
+                error = -1;
+            }
+            continue;
+        }
+
+        for (int i = 0; i < n && error == 0; ++i) {
+            if (evs[i].data.fd == lsock) {
+                error = accept_conn(lsock, &delay_ms);
+            } else {
+                /* One-shot: not reported again until a worker re-arms it */
+                queue_conn(evs[i].data.fd);
+            }
+        }
+    }
+
+    /* New clients now get ECONNREFUSED rather than a lost request */
+    epoll_ctl(pool.epfd, EPOLL_CTL_DEL, lsock, NULL);
+    close(lsock);
+    unlink_path(sock_path, &sock_st);
+    pool_stop();
+
+    /* Idle connections that sent something meanwhile get an answer too */
+    while ((n = epoll_wait(pool.epfd, evs, DAEMON_EVENTS, 0)) > 0) {
+        for (int i = 0; i < n; ++i) {
+            reject_conn(evs[i].data.fd);
+        }
+    }
+    close(pool.epfd);
+
+    pthread_sigmask(SIG_SETMASK, &orig, NULL);
+    return error;
+}
+
+/*
+ * Client side: have the daemon at `sock_path' invert each of `paths'
+ * in `mode'. Files are passed by descriptor for in-place requests
+ * and by absolute path otherwise. Returns the number of failures, or
+ * -1 if the daemon cannot be reached.
+ */
+int
+daemon_request(const char *sock_path, char **paths, size_t npaths, int mode)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct daemon_req req = { .magic = DAEMON_MAGIC, .mode = mode };
+    struct daemon_reply reply;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctl;
+    struct iovec iov = { &req, 0 };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+    struct cmsghdr *cmsg;
+    int sock, fd, nerrors = 0;
+
+    if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: %s\n", sock_path, strerror(ENAMETOOLONG));
+        return -1;
+    }
+    strcpy(addr.sun_path, sock_path);
+
+    sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&addr,
+                            sizeof(addr)) != 0) {
+        fprintf(stderr, "%s: %s\n", sock_path, strerror(errno));
+        if (sock >= 0) {
+            close(sock);
+        }
+        return -1;
+    }
+
+    for (size_t i = 0; i < npaths; ++i) {
+        fd = -1;
+        req.path[0] = '\0';
+        msg.msg_control = NULL;
+        msg.msg_controllen = 0;
+
+        if (mode == DAEMON_MODE_INPLACE) {
+            if ((fd = open(paths[i], O_RDWR)) < 0) {
+                fprintf(stderr, "%s: %s\n", paths[i], strerror(errno));
+                ++nerrors;
+                continue;
+            }
+            msg.msg_control = ctl.buf;
+            msg.msg_controllen = sizeof(ctl.buf);
+            cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+        } else if (realpath(paths[i], req.path) == NULL) {
+            /* The daemon's working directory is not ours */
+            fprintf(stderr, "%s: %s\n", paths[i], strerror(errno));
+            ++nerrors;
+            continue;
+        }
+
+        iov.iov_len = offsetof(struct daemon_req, path) + strlen(req.path) + 1;
+        if (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0 ||
+            recv(sock, &reply, sizeof(reply), 0) != sizeof(reply) ||
+            reply.magic != DAEMON_MAGIC) {
+            fprintf(stderr, "%s: lost connection to daemon\n", sock_path);
+            if (fd >= 0) {
+                close(fd);
+            }
+            close(sock);
+            return -1;
+        }
+
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (reply.error != 0) {
+            fprintf(stderr, "%s: %s\n", paths[i], strerror(reply.error));
+            ++nerrors;
+        }
+    }
+
+    close(sock);
+    return nerrors;
+}
@@ -0,0 +1,412 @@
+/*
+ * Copyright (c) 2023-2024 Ian Marco Moffett and the Osmora team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Osmora nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <pthread.h>
+#include <encrypt.h>
+#include <tune.h>
+#include <stats.h>
+#include <perf.h>
+#if defined(__x86_64__)
+#include <accel.h>
+#endif  /* defined(__x86_64__) */
+
+/* Bulk alignment and granularity, one cache line */
+#define BULK_ALIGN  64
+#define BULK_BLOCK  64
+
+#define flip_block(TMP_VAR, TYPE, BUF, POS)         \
+        TMP_VAR = *(TYPE *)&BUF[POS];               \
+        TMP_VAR = ~TMP_VAR;                         \
+        *(TYPE *)&BUF[POS] = TMP_VAR;               \
+
+/* Per-thread work for encrypt_parallel() */
+struct encrypt_work {
+    const struct cpu_info *info;
+    char *buf;
+    size_t size;
+};
+
+static const char *kernel_names[] = {
+    [ENCRYPT_SCALAR]    = "scalar64",
+    [ENCRYPT_SSE]       = "sse128",
+    [ENCRYPT_AVX]       = "avx256",
+    [ENCRYPT_AVX512]    = "avx512"
+};
+
+/*
+ * Widest kernel this CPU supports.
+ */
+int
+encrypt_max_kernel(const struct cpu_info *info)
+{
+#if defined(__x86_64__)
+    if (info->has_avx512) {
+        return ENCRYPT_AVX512;
+    }
+    if (info->has_avx2) {
+        return ENCRYPT_AVX;
+    }
+    if (info->has_sse2 || info->has_sse3) {
+        return ENCRYPT_SSE;
+    }
+#endif  /* defined(__x86_64__) */
+    return ENCRYPT_SCALAR;
+}
+
+/*
+ * Kernel encrypt() will actually use: the widest one supported,
+ * capped by the tuning profile.
+ */
+static int
+effective_kernel(const struct cpu_info *info)
+{
+    int kernel = encrypt_max_kernel(info);
+
+    return (g_tune.kernel < kernel) ? g_tune.kernel : kernel;
+}
+
+const char *
+encrypt_kernel_name(int kernel)
+{
+    return kernel_names[kernel];
+}
+
+/*
+ * Name of the kernel encrypt() will use on this CPU.
+ */
+const char *
+encrypt_kernel(const struct cpu_info *info)
+{
+    return kernel_names[effective_kernel(info)];
+}
+
+/*
+ * Invert a piece shorter than BULK_BLOCK: the unaligned head or the
+ * tail of a buffer.
+ */
+static void
+invert_edge(int kernel, char *buf, size_t buf_size)
+{
+    size_t current_pos;
+    size_t step;
+    uint64_t tmp;
+
+#if defined(__x86_64__)
+    /*
+     * The AVX kernels finish any edge in one or two operations
+     * instead of halving the step down to single bytes.
+     */
+    if (kernel == ENCRYPT_AVX512) {
+        accel_invert_tail512((uintptr_t)buf, buf_size);
+        return;
+    }
+
+    if (kernel == ENCRYPT_AVX) {
+        if (buf_size >= 32) {
+            accel_invert256((uintptr_t)buf);
+            buf += 32;
+            buf_size -= 32;
+        }
+        accel_invert_tail256((uintptr_t)buf, buf_size);
+        return;
+    }
+#endif  /* defined(__x86_64__) */
+
+    current_pos = 0;
+    step = 8;           /* Start at 8 bytes (64 bits) */
+
+#if defined(__x86_64__)
+    if (kernel >= ENCRYPT_SSE) {
+        step = 16;         /* Start at 16 bytes (128 bits) */
+    }
+#endif  /* defined(__x86_64__) */
+
+    while (current_pos < buf_size) {
+        /* Ensure we aren't over 16 bytes and a power of two */
+        if (step != 1) {
+            assert((step & 1) == 0 && step <= 16);
+        }
+
+        /* Ensure we don't cause any overflows */
+        while (((current_pos + step) >= buf_size) && step > 1)
+            /* Essentially divide the step by 2, just faster */
+            step >>= 1;
+
+        switch (step) {
+#if defined(__x86_64__)
+        case 16:
+            accel_invert128((uintptr_t)buf + current_pos);
+            break;
+#endif  /* defined(__x86_64__) */
+        case 8:
+            flip_block(tmp, uint64_t, buf, current_pos);
+            break;
+        case 4:
+            flip_block(tmp, uint32_t, buf, current_pos);
+            break;
+        case 2:
+            flip_block(tmp, uint16_t, buf, current_pos);
+            break;
+        case 1:
+            flip_block(tmp, uint8_t, buf, current_pos);
+            break;
+        }
+
+        current_pos += step;
+    }
+}
+
+/*
+ * Invert the BULK_ALIGN aligned `buf', `buf_size' being a multiple
+ * of BULK_BLOCK, optionally with non-temporal stores.
+ */
+static void
+invert_bulk(int kernel, char *buf, size_t buf_size, bool nt)
+{
+    uint64_t tmp;
+
+    switch (kernel) {
+#if defined(__x86_64__)
+    case ENCRYPT_AVX512:
+        if (nt) {
+            accel_invert_nt512((uintptr_t)buf, buf_size);
+        } else {
+            accel_invert_bulk512((uintptr_t)buf, buf_size);
+        }
+        return;
+    case ENCRYPT_AVX:
+        if (nt) {
+            accel_invert_nt256((uintptr_t)buf, buf_size);
+        } else {
+            accel_invert_bulk256((uintptr_t)buf, buf_size);
+        }
+        return;
+    case ENCRYPT_SSE:
+        if (nt) {
+            accel_invert_nt128((uintptr_t)buf, buf_size);
+        } else {
+            accel_invert_bulk128((uintptr_t)buf, buf_size);
+        }
+        return;
+#endif  /* defined(__x86_64__) */
+    default:
+        for (size_t pos = 0; pos < buf_size; pos += sizeof(tmp)) {
+            flip_block(tmp, uint64_t, buf, pos);
+        }
+        return;
+    }
+}
+
+/*
+ * Invert `buf' in three parts so that throughput does not depend on
+ * its alignment: an unaligned head up to the next BULK_ALIGN
+ * boundary, an aligned bulk that can use aligned and non-temporal
+ * stores, and a short tail.
+ */
+char *
+encrypt(const struct cpu_info *info, char *buf, size_t buf_size)
+{
+    size_t head, bulk;
+    uint64_t start;
+    int kernel;
+    bool nt;
+    struct perf_sample ps;
+
+    start = stats_begin();
+    perf_begin(&ps);
+    kernel = effective_kernel(info);
+
+    head = -(uintptr_t)buf & (BULK_ALIGN - 1);
+    if (head > buf_size) {
+        head = buf_size;
+    }
+    bulk = (buf_size - head) & ~(size_t)(BULK_BLOCK - 1);
+
+    /*
+     * Big buffers won't be looked at again before they are written
+     * out, so stream the bulk past the cache.
+     */
+    nt = buf_size >= g_tune.nt_threshold && kernel >= ENCRYPT_SSE;
+
+    invert_edge(kernel, buf, head);
+    invert_bulk(kernel, buf + head, bulk, nt);
+    invert_edge(kernel, buf + head + bulk, buf_size - head - bulk);
+
+    perf_end(&ps, buf_size);
+    stats_end(STATS_INVERT, start, buf_size);
+    return buf;
+}
+
+static void
+invert_page(int kernel, char *buf)
+{
+    uint64_t tmp;
+
+    switch (kernel) {
+#if defined(__x86_64__)
+    case ENCRYPT_AVX512:
+        accel_invert4k_512((uintptr_t)buf);
+        return;
+    case ENCRYPT_AVX:
+        accel_invert4k_256((uintptr_t)buf);
+        return;
+    case ENCRYPT_SSE:
+        accel_invert4k_128((uintptr_t)buf);
+        return;
+#endif  /* defined(__x86_64__) */
+    default:
+        for (size_t pos = 0; pos < ENCRYPT_PAGE; pos += sizeof(tmp)) {
+            flip_block(tmp, uint64_t, buf, pos);
+        }
+        return;
+    }
+}
+
+static void
+invert_block(int kernel, char *buf)
+{
+    switch (kernel) {
+#if defined(__x86_64__)
+    case ENCRYPT_AVX512:
+        accel_invert64k_512((uintptr_t)buf);
+        return;
+    case ENCRYPT_AVX:
+        accel_invert64k_256((uintptr_t)buf);
+        return;
+    case ENCRYPT_SSE:
+        accel_invert64k_128((uintptr_t)buf);
+        return;
+#endif  /* defined(__x86_64__) */
+    default:
+        for (size_t pos = 0; pos < ENCRYPT_BLOCK; pos += ENCRYPT_PAGE) {
+            invert_page(kernel, buf + pos);
+        }
+        return;
+    }
+}
+
+/*
+ * encrypt() for the chunked paths, whose chunk sizes are whole pages.
+ * Whole 64 KiB blocks and then whole 4 KiB pages go through the size
+ * specialised kernels, which carry no length or alignment checks.
+ * Anything else, or a buffer big enough to want non-temporal stores,
+ * takes the general path.
+ */
+char *
+encrypt_fixed(const struct cpu_info *info, char *buf, size_t buf_size)
+{
+    size_t pos;
+    uint64_t start;
+    int kernel;
+    struct perf_sample ps;
+
+    if ((buf_size & (ENCRYPT_PAGE - 1)) != 0 ||
+        buf_size >= g_tune.nt_threshold) {
+        return encrypt(info, buf, buf_size);
+    }
+
+    start = stats_begin();
+    perf_begin(&ps);
+    kernel = effective_kernel(info);
+
+    for (pos = 0; buf_size - pos >= ENCRYPT_BLOCK; pos += ENCRYPT_BLOCK) {
+        invert_block(kernel, buf + pos);
+    }
+    for (; pos < buf_size; pos += ENCRYPT_PAGE) {
+        invert_page(kernel, buf + pos);
+    }
+
+    perf_end(&ps, buf_size);
+    stats_end(STATS_INVERT, start, buf_size);
+    return buf;
+}
+
+static void *
+encrypt_worker(void *arg)
+{
+    struct encrypt_work *work = arg;
+
+    encrypt(work->info, work->buf, work->size);
+    return NULL;
+}
+
+/*
+ * Invert `buf' using `nthreads' threads (the caller included), each
+ * taking a contiguous slice made of whole tuning chunks.
+ */
+char *
+encrypt_parallel(const struct cpu_info *info, char *buf, size_t buf_size,
+                 int nthreads)
+{
+    struct encrypt_work work[ENCRYPT_MAX_THREADS];
+    pthread_t threads[ENCRYPT_MAX_THREADS];
+    bool started[ENCRYPT_MAX_THREADS];
+    size_t nchunks, per_thread, off;
+    int i;
+
+    if (nthreads > ENCRYPT_MAX_THREADS) {
+        nthreads = ENCRYPT_MAX_THREADS;
+    }
+
+    nchunks = buf_size / g_tune.chunk_size;
+    if (nthreads <= 1 || nchunks < (size_t)nthreads) {
+        return encrypt(info, buf, buf_size);
+    }
+
+    per_thread = (nchunks / nthreads) * g_tune.chunk_size;
+    off = 0;
+    for (i = 0; i < nthreads; ++i) {
+        work[i].info = info;
+        work[i].buf = buf + off;
+        work[i].size = (i == nthreads - 1) ? buf_size - off : per_thread;
+        off += per_thread;
+    }
+
+    /* Slice 0 runs on the calling thread */
+    for (i = 1; i < nthreads; ++i) {
+        started[i] = pthread_create(&threads[i], NULL, encrypt_worker,
+                                    &work[i]) == 0;
+        if (!started[i]) {
+            encrypt_worker(&work[i]);
+        }
+    }
+
+    encrypt_worker(&work[0]);
+
+    for (i = 1; i < nthreads; ++i) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    return buf;
+}
@@ -0,0 +1,674 @@
+/*
+ * Copyright (c) 2023-2024 Ian Marco Moffett and the Osmora team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Osmora nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <fileio.h>
+#include <sparse.h>
+
+/* Largest single write() issued when replacing a file */
+#define ATOMIC_WRITE_MAX    (64UL << 20)
+
+/* Unit of writeback_file() */
+#define IO_CHUNK            (8UL << 20)
+
+/*
+ * Read all of `fname' into a new buffer. A file that has grown past
+ * `max' bytes (what the caller budgeted for) is not read: NULL is
+ * returned with errno set to EFBIG and no message, so the caller can
+ * fall back to streaming it.
+ */
+char *
+read_file(const char *fname, size_t max, size_t *size_out)
+{
+    FILE *fp;
+    char *buf;
+    size_t bufsize;
+    long len;
+
+    if (access(fname, F_OK) != 0) {
+        fprintf(stderr, "%s does not exist!\n", fname);
+        return NULL;
+    }
+
+    if ((fp = fopen(fname, "r")) == NULL) {
+        fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+        return NULL;
+    }
+
+    /* Get file size */
+    if (fseek(fp, 0, SEEK_END) != 0 || (len = ftell(fp)) < 0 ||
+        fseek(fp, 0, SEEK_SET) != 0) {
+        fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+        fclose(fp);
+        return NULL;
+    }
+    bufsize = len;
+    if (bufsize > max) {
+        fclose(fp);
+        errno = EFBIG;
+        return NULL;
+    }
+
+    /* Read ahead hard; whatever we cache here gets overwritten anyway */
+    posix_fadvise(fileno(fp), 0, bufsize, POSIX_FADV_SEQUENTIAL);
+
+    /* malloc(0) may return NULL; an empty file still needs a buffer */
+    if ((buf = malloc(bufsize != 0 ? bufsize : 1)) == NULL) {
+        fprintf(stderr, "%s: %s\n", fname, strerror(ENOMEM));
+        fclose(fp);
+        return NULL;
+    }
+
+    /*
+     * A short read would have us invert and write back a partly
+     * filled buffer, so it fails the whole file.
+     */
+    if (fread(buf, sizeof(char), bufsize, fp) != bufsize) {
+        fprintf(stderr, "%s: %s\n", fname,
+                ferror(fp) ? strerror(errno) : "file shrank while reading");
+        free(buf);
+        fclose(fp);
+        return NULL;
+    }
+    if (bufsize >= IO_SMOOTH_MIN) {
+        posix_fadvise(fileno(fp), 0, bufsize, POSIX_FADV_DONTNEED);
+    }
+    fclose(fp);
+
+    *size_out = bufsize;
+
+    return buf;
+}
+
+/*
+ * Overwrite `fname' with `buf' in place.
+ *
+ * The file is not truncated first: the new contents are the same size
+ * as the old, so writing over the existing blocks keeps their
+ * allocation, and the filesystem does not have to free every extent
+ * only to allocate (and fragment) them again.
+ */
+int
+writeback_file(const char *fname, const char *buf, size_t buf_size)
+{
+    struct io_stream ios;
+    struct stat st;
+    size_t off, n;
+    int fd;
+
+    if ((fd = open(fname, O_WRONLY)) < 0) {
+        fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+        return -1;
+    }
+
+    io_stream_init(&ios, fd, 0, buf_size, buf_size >= IO_SMOOTH_MIN);
+
+    /* In chunks, so writeback can start behind us */
+    for (off = 0; off < buf_size; off += n) {
+        n = (buf_size - off > IO_CHUNK) ? IO_CHUNK : buf_size - off;
+        if (pwrite_full(fd, buf + off, n, off) != 0) {
+            fprintf(stderr, "%s: write failed: %s\n", fname, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        io_stream_written(&ios, off, n);
+    }
+
+    io_stream_finish(&ios);
+
+    /* Only if it grew since we read it */
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size > buf_size &&
+        ftruncate(fd, buf_size) != 0) {
+        fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (close(fd) != 0) {
+        fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Read until `len' bytes are in `buf' or EOF is hit.
+ * Returns the number of bytes read or -1 on error.
+ */
+ssize_t
+read_full(int fd, char *buf, size_t len)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len) {
+        n = read(fd, buf + done, len - done);
+        if (n == 0) {
+            break;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += n;
+    }
+
+    return done;
+}
+
+int
+write_full(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, buf, (len > ATOMIC_WRITE_MAX) ? ATOMIC_WRITE_MAX : len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * Like read_full() but at offset `off'.
+ */
+ssize_t
+pread_full(int fd, char *buf, size_t len, off_t off)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len) {
+        n = pread(fd, buf + done, len - done, off + done);
+        if (n == 0) {
+            break;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += n;
+    }
+
+    return done;
+}
+
+int
+pwrite_full(int fd, const char *buf, size_t len, off_t off)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = pwrite(fd, buf, len, off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+        off += n;
+    }
+
+    return 0;
+}
+
+/*
+ * Start a pass over [off, off + len) of `fd', telling the kernel to
+ * read ahead aggressively. With `smooth' (meant for streams of
+ * IO_SMOOTH_MIN and up) written chunks are also pushed to disk as we
+ * go and dropped from the page cache one chunk behind, so dirty pages
+ * never pile up to dirty_ratio and stall the whole run at once, and
+ * a pass over a huge file does not evict everything else.
+ */
+void
+io_stream_init(struct io_stream *ios, int fd, off_t off, off_t len,
+               bool smooth)
+{
+    ios->fd = fd;
+    ios->smooth = smooth;
+    ios->prev_off = 0;
+    ios->prev_len = 0;
+    posix_fadvise(fd, off, len, POSIX_FADV_SEQUENTIAL);
+}
+
+/*
+ * A chunk of a file we only read from has been consumed.
+ */
+void
+io_stream_read(struct io_stream *ios, off_t off, size_t len)
+{
+    if (ios->smooth) {
+        posix_fadvise(ios->fd, off, len, POSIX_FADV_DONTNEED);
+    }
+}
+
+/*
+ * A chunk has been written: start its writeback, then wait for the
+ * previous chunk's (by now mostly done) and drop it from the cache.
+ */
+void
+io_stream_written(struct io_stream *ios, off_t off, size_t len)
+{
+    if (!ios->smooth) {
+        return;
+    }
+
+    sync_file_range(ios->fd, off, len, SYNC_FILE_RANGE_WRITE);
+    if (ios->prev_len != 0) {
+        sync_file_range(ios->fd, ios->prev_off, ios->prev_len,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                        SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(ios->fd, ios->prev_off, ios->prev_len,
+                      POSIX_FADV_DONTNEED);
+    }
+
+    ios->prev_off = off;
+    ios->prev_len = len;
+}
+
+/*
+ * End of the pass. The last chunk is left to finish writeback on its
+ * own; waiting for it here would only add latency.
+ */
+void
+io_stream_finish(struct io_stream *ios)
+{
+    ios->prev_len = 0;
+}
+
+/*
+ * Write the directory part of `fname' to `dir'.
+ */
+static void
+parent_dir(const char *fname, char *dir, size_t dir_size)
+{
+    const char *slash;
+
+    slash = strrchr(fname, '/');
+    if (slash == NULL) {
+        snprintf(dir, dir_size, ".");
+    } else if (slash == fname) {
+        snprintf(dir, dir_size, "/");
+    } else {
+        snprintf(dir, dir_size, "%.*s", (int)(slash - fname), fname);
+    }
+}
+
+/*
+ * Is `path' one of our own sidecar files? Those are never processed:
+ * inverting a journal or another run's temporary would undo the
+ * protection it exists for.
+ */
+bool
+is_sidecar(const char *path)
+{
+    const char *base;
+
+    base = strrchr(path, '/');
+    base = (base == NULL) ? path : base + 1;
+    return strncmp(base, SIDECAR_PREFIX, sizeof(SIDECAR_PREFIX) - 1) == 0;
+}
+
+/*
+ * Write the name of the sidecar of `fname' ending in `suffix' to
+ * `out': "<dir>/" SIDECAR_PREFIX "<base><suffix>". Returns -1 with
+ * errno set to ENAMETOOLONG if it does not fit.
+ */
+int
+sidecar_path(char *out, size_t out_size, const char *fname,
+             const char *suffix)
+{
+    const char *slash;
+    int n;
+
+    slash = strrchr(fname, '/');
+    if (slash == NULL) {
+        n = snprintf(out, out_size, SIDECAR_PREFIX "%s%s", fname, suffix);
+    } else {
+        n = snprintf(out, out_size, "%.*s" SIDECAR_PREFIX "%s%s",
+                     (int)(slash - fname + 1), fname, slash + 1, suffix);
+    }
+
+    if (n < 0 || (size_t)n >= out_size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * fsync() the directory holding `path', making a file just created
+ * there (or renamed into it) survive a crash. Returns 0 or -1 with
+ * errno set.
+ */
+int
+sync_parent(const char *path)
+{
+    char dir[PATH_MAX];
+    int dirfd, error;
+
+    parent_dir(path, dir, sizeof(dir));
+    if ((dirfd = open(dir, O_RDONLY | O_DIRECTORY)) < 0) {
+        return -1;
+    }
+
+    error = fsync(dirfd);
+    close(dirfd);
+    return error;
+}
+
+/*
+ * Open an anonymous file in `dir' with O_TMPFILE, falling back to a
+ * named temporary when the filesystem does not support it. On the
+ * fallback path `tmpname' holds the name that must be unlinked on
+ * failure, otherwise it is left empty.
+ */
+static int
+open_temp(const char *dir, const char *fname, mode_t mode, char *tmpname,
+          size_t tmpname_size)
+{
+    const char *base;
+    int fd, n;
+
+    tmpname[0] = '\0';
+
+#if defined(O_TMPFILE)
+    fd = open(dir, O_TMPFILE | O_WRONLY, mode);
+    if (fd >= 0) {
+        return fd;
+    }
+#endif  /* defined(O_TMPFILE) */
+
+    base = strrchr(fname, '/');
+    base = (base == NULL) ? fname : base + 1;
+    n = snprintf(tmpname, tmpname_size, "%s/" SIDECAR_PREFIX "%s.XXXXXX", dir,
+                 base);
+    if (n < 0 || (size_t)n >= tmpname_size) {
+        tmpname[0] = '\0';
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    fd = mkstemp(tmpname);
+    if (fd < 0) {
+        tmpname[0] = '\0';
+    }
+
+    return fd;
+}
+
+/*
+ * Give an O_TMPFILE inode a name in `dir' so it can be renamed
+ * over the target. The name is written to `tmpname'.
+ */
+static int
+link_temp(int fd, const char *dir, const char *fname, char *tmpname,
+          size_t tmpname_size)
+{
+    char procpath[sizeof("/proc/self/fd/") + 3 * sizeof(int)];
+    const char *base;
+    int n;
+
+    base = strrchr(fname, '/');
+    base = (base == NULL) ? fname : base + 1;
+    snprintf(procpath, sizeof(procpath), "/proc/self/fd/%d", fd);
+
+    for (int i = 0; i < 16; ++i) {
+        n = snprintf(tmpname, tmpname_size, "%s/" SIDECAR_PREFIX "%s.%d.%d",
+                     dir, base, (int)getpid(), i);
+        if (n < 0 || (size_t)n >= tmpname_size) {
+            errno = ENAMETOOLONG;
+            break;
+        }
+
+        if (linkat(AT_FDCWD, procpath, AT_FDCWD, tmpname,
+                   AT_SYMLINK_FOLLOW) == 0) {
+            return 0;
+        }
+        if (errno != EEXIST) {
+            break;
+        }
+    }
+
+    tmpname[0] = '\0';
+    return -1;
+}
+
+/*
+ * Write `buf' to the temporary `fd' with the same holes as the
+ * original `fname': only its data extents are written, the rest is
+ * left unallocated.
+ */
+static int
+write_sparse(int fd, const char *fname, const char *buf, size_t buf_size)
+{
+    off_t pos = 0, data, data_end;
+    int src, r;
+
+    if ((src = open(fname, O_RDONLY)) < 0) {
+        return -1;
+    }
+
+    while ((r = sparse_next_data(src, pos, buf_size, &data, &data_end)) > 0) {
+        if (fallocate(fd, 0, data, data_end - data) != 0 && errno == ENOSPC) {
+            r = -1;
+            break;
+        }
+        if (pwrite_full(fd, buf + data, data_end - data, data) != 0) {
+            r = -1;
+            break;
+        }
+        pos = data_end;
+    }
+
+    close(src);
+    if (r == 0 && ftruncate(fd, buf_size) != 0) {
+        r = -1;
+    }
+
+    return r;
+}
+
+/*
+ * Start replacing `fname' such that a crash at any point leaves
+ * either the old or the new contents in place, never a mix.
+ *
+ * The new contents are written to at->fd, a temporary file in the
+ * same directory, which atomic_commit() fsync()s and renames over
+ * the original.
+ */
+int
+atomic_open(struct atomic_tmp *at, const char *fname)
+{
+    int fd;
+
+    if ((fd = open(fname, O_RDONLY)) < 0 || fstat(fd, &at->st) != 0) {
+        fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    if (sparse_check(fd, &at->st, fname) != 0) {
+        close(fd);
+        return -1;
+    }
+    at->marked = sparse_marked(fd);
+    close(fd);
+
+    parent_dir(fname, at->dir, sizeof(at->dir));
+    at->fd = open_temp(at->dir, fname, at->st.st_mode & 07777, at->tmpname,
+                       sizeof(at->tmpname));
+    if (at->fd < 0) {
+        fprintf(stderr, "%s: cannot create temporary: %s\n", at->dir,
+                strerror(errno));
+        return -1;
+    }
+
+    /* Reserve the blocks up front so ENOSPC shows up before we write */
+    if (!sparse_file(&at->st) && at->st.st_size > 0 &&
+        fallocate(at->fd, 0, 0, at->st.st_size) != 0 && errno == ENOSPC) {
+        fprintf(stderr, "%s: %s\n", at->dir, strerror(errno));
+        atomic_abort(at);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Put the fully written temporary in place of `fname' and close it.
+ * On failure the temporary is removed.
+ */
+int
+atomic_commit(struct atomic_tmp *at, const char *fname)
+{
+    int dirfd;
+
+    /*
+     * Keep ownership (if we may) and permissions of the original.
+     * fchown() clears set-user-ID and set-group-ID, so it goes first.
+     */
+    if (fchown(at->fd, at->st.st_uid, at->st.st_gid) != 0) {
+        if (errno != EPERM) {
+            fprintf(stderr, "%s: chown failed: %s\n", at->dir,
+                    strerror(errno));
+            goto fail;
+        }
+        fprintf(stderr, "%s: cannot keep its owner, now owned by us\n",
+                fname);
+    }
+
+    if (fchmod(at->fd, at->st.st_mode & 07777) != 0) {
+        fprintf(stderr, "%s: chmod failed: %s\n", at->dir, strerror(errno));
+        goto fail;
+    }
+
+    /* The temporary starts untagged; tag it if it now needs the holes */
+    if (sparse_file(&at->st) && !at->marked) {
+        sparse_mark(at->fd, true);
+    }
+
+    if (fsync(at->fd) != 0) {
+        fprintf(stderr, "%s: fsync failed: %s\n", at->dir, strerror(errno));
+        goto fail;
+    }
+
+    if (at->tmpname[0] == '\0' &&
+        link_temp(at->fd, at->dir, fname, at->tmpname,
+                  sizeof(at->tmpname)) != 0) {
+        fprintf(stderr, "%s: cannot link temporary: %s\n", at->dir,
+                strerror(errno));
+        goto fail;
+    }
+
+    if (rename(at->tmpname, fname) != 0) {
+        fprintf(stderr, "%s: rename failed: %s\n", fname, strerror(errno));
+        goto fail;
+    }
+
+    close(at->fd);
+
+    /* Make the rename itself durable */
+    dirfd = open(at->dir, O_RDONLY | O_DIRECTORY);
+    if (dirfd >= 0) {
+        fsync(dirfd);
+        close(dirfd);
+    }
+
+    return 0;
+fail:
+    atomic_abort(at);
+    return -1;
+}
+
+/*
+ * Throw away a temporary from atomic_open().
+ */
+void
+atomic_abort(struct atomic_tmp *at)
+{
+    if (at->tmpname[0] != '\0') {
+        unlink(at->tmpname);
+    }
+    close(at->fd);
+}
+
+/*
+ * Atomically replace `fname' with `buf'.
+ */
+int
+writeback_atomic(const char *fname, const char *buf, size_t buf_size)
+{
+    struct atomic_tmp at;
+    int error;
+
+    if (atomic_open(&at, fname) != 0) {
+        return -1;
+    }
+
+    if (sparse_file(&at.st)) {
+        /* Keep the holes of the original */
+        error = write_sparse(at.fd, fname, buf, buf_size);
+    } else {
+        error = write_full(at.fd, buf, buf_size);
+    }
+
+    if (error != 0) {
+        fprintf(stderr, "%s: write failed: %s\n", at.dir, strerror(errno));
+        atomic_abort(&at);
+        return -1;
+    }
+
+    return atomic_commit(&at, fname);
+}
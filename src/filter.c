@@ -0,0 +1,316 @@
+/*
+ * Copyright (c) 2023-2024 Ian Marco Moffett and the Osmora team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Osmora nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Filter mode: read stdin, invert, write stdout.
+ *
+ * A reader thread fills a small ring of chunks and inverts each one
+ * while it is still hot in cache; the calling thread drains the ring
+ * to the output. When the output is a pipe the chunks are handed to
+ * the kernel with vmsplice() instead of being copied by write().
+ *
+ * vmsplice() only places references to our pages in the pipe, and
+ * whoever reads the pipe may pass them on (splice to a socket, tee)
+ * and hold them for as long as it likes, so spliced pages must never
+ * be written again. Each chunk is gifted (SPLICE_F_GIFT) and then
+ * replaced by fresh anonymous pages mapped over the same range; the
+ * old ones belong to the pipe alone and are freed when its last
+ * holder lets go.
+ */
+
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <encrypt.h>
+#include <filter.h>
+#include <fileio.h>
+#include <sparse.h>
+#include <stats.h>
+#include <tune.h>
+
+struct filter_chunk {
+    char *data;
+    size_t len;
+};
+
+struct filter_ctx {
+    const struct cpu_info *info;
+    int in_fd;
+    int out_fd;
+    size_t chunk_size;
+    bool splice_out;
+    struct filter_chunk ring[FILTER_NBUF];
+
+    pthread_mutex_t lock;
+    pthread_cond_t filled_cv;
+    pthread_cond_t freed_cv;
+    size_t nfilled;         /* Chunks produced by the reader */
+    size_t nreleased;       /* Chunks the reader may overwrite */
+    bool eof;
+    int error;
+};
+
+static bool
+is_pipe(int fd)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) != 0) {
+        return false;
+    }
+
+    return S_ISFIFO(st.st_mode);
+}
+
+/*
+ * Try to grow a pipe to `want' bytes and return its
+ * resulting capacity (0 if `fd' is not a pipe).
+ */
+static size_t
+grow_pipe(int fd, size_t want)
+{
+    int size;
+
+    fcntl(fd, F_SETPIPE_SZ, (int)want);
+    size = fcntl(fd, F_GETPIPE_SZ);
+    return (size < 0) ? 0 : (size_t)size;
+}
+
+static int
+splice_full(int fd, char *buf, size_t len)
+{
+    struct iovec iov;
+    ssize_t n;
+
+    while (len > 0) {
+        iov.iov_base = buf;
+        iov.iov_len = len;
+        n = vmsplice(fd, &iov, 1, SPLICE_F_GIFT);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * Swap the pages behind `chunk' for fresh ones, leaving the old
+ * pages to whatever still references them.
+ */
+static int
+chunk_renew(struct filter_chunk *chunk, size_t size)
+{
+    void *p;
+
+    p = mmap(chunk->data, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    return (p == MAP_FAILED) ? -1 : 0;
+}
+
+static void *
+filter_reader(void *arg)
+{
+    struct filter_ctx *ctx = arg;
+    struct filter_chunk *chunk;
+    uint64_t start;
+    ssize_t n;
+
+    for (;;) {
+        pthread_mutex_lock(&ctx->lock);
+        while (ctx->nfilled - ctx->nreleased >= FILTER_NBUF && !ctx->error) {
+            pthread_cond_wait(&ctx->freed_cv, &ctx->lock);
+        }
+        if (ctx->error) {
+            pthread_mutex_unlock(&ctx->lock);
+            break;
+        }
+        chunk = &ctx->ring[ctx->nfilled % FILTER_NBUF];
+        pthread_mutex_unlock(&ctx->lock);
+
+        start = stats_begin();
+        n = read_full(ctx->in_fd, chunk->data, ctx->chunk_size);
+        stats_end(STATS_READ, start, (n > 0) ? n : 0);
+        if (n > 0) {
+            encrypt_fixed(ctx->info, chunk->data, n);
+        }
+
+        pthread_mutex_lock(&ctx->lock);
+        if (n < 0) {
+            ctx->error = errno;
+        } else if (n == 0) {
+            ctx->eof = true;
+        } else {
+            chunk->len = n;
+            ++ctx->nfilled;
+            /* A short read means EOF */
+            ctx->eof = (size_t)n < ctx->chunk_size;
+        }
+        pthread_cond_signal(&ctx->filled_cv);
+        pthread_mutex_unlock(&ctx->lock);
+
+        if (n <= 0 || ctx->eof) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static int
+filter_writer(struct filter_ctx *ctx)
+{
+    struct filter_chunk *chunk;
+    size_t nwritten = 0;
+    uint64_t start;
+    int error;
+
+    for (;;) {
+        pthread_mutex_lock(&ctx->lock);
+        while (nwritten == ctx->nfilled && !ctx->eof && !ctx->error) {
+            pthread_cond_wait(&ctx->filled_cv, &ctx->lock);
+        }
+        if (ctx->error || nwritten == ctx->nfilled) {
+            pthread_mutex_unlock(&ctx->lock);
+            break;
+        }
+        chunk = &ctx->ring[nwritten % FILTER_NBUF];
+        pthread_mutex_unlock(&ctx->lock);
+
+        start = stats_begin();
+        if (ctx->splice_out) {
+            error = splice_full(ctx->out_fd, chunk->data, chunk->len);
+            if (error == 0) {
+                error = chunk_renew(chunk, ctx->chunk_size);
+            }
+        } else {
+            error = write_full(ctx->out_fd, chunk->data, chunk->len);
+        }
+        stats_end(STATS_WRITE, start, chunk->len);
+
+        pthread_mutex_lock(&ctx->lock);
+        if (error != 0) {
+            ctx->error = errno;
+        }
+        ++nwritten;
+        ctx->nreleased = nwritten;
+        pthread_cond_signal(&ctx->freed_cv);
+        pthread_mutex_unlock(&ctx->lock);
+    }
+
+    return ctx->error;
+}
+
+int
+filter_stream(const struct cpu_info *info, int in_fd, int out_fd)
+{
+    struct filter_ctx ctx;
+    pthread_t reader;
+    size_t pipe_size;
+    int error;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.info = info;
+    ctx.in_fd = in_fd;
+    ctx.out_fd = out_fd;
+    ctx.chunk_size = g_tune.chunk_size;
+
+    /* A stream has no holes, so it would come out wrong (see sparse.c) */
+    if (sparse_marked(in_fd)) {
+        fprintf(stderr, "stdin: was obfuscated with its holes kept; "
+                "decode it in place instead\n");
+        return EINVAL;
+    }
+
+    if (is_pipe(in_fd)) {
+        grow_pipe(in_fd, ctx.chunk_size);
+    }
+
+    if (is_pipe(out_fd)) {
+        pipe_size = grow_pipe(out_fd, ctx.chunk_size);
+        if (pipe_size != 0) {
+            ctx.splice_out = true;
+            ctx.chunk_size = pipe_size;
+        }
+    }
+
+    for (int i = 0; i < FILTER_NBUF; ++i) {
+        ctx.ring[i].data = mmap(NULL, ctx.chunk_size, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ctx.ring[i].data == MAP_FAILED) {
+            fprintf(stderr, "Failed to allocate filter buffers\n");
+            while (i-- > 0) {
+                munmap(ctx.ring[i].data, ctx.chunk_size);
+            }
+            return ENOMEM;
+        }
+    }
+
+    pthread_mutex_init(&ctx.lock, NULL);
+    pthread_cond_init(&ctx.filled_cv, NULL);
+    pthread_cond_init(&ctx.freed_cv, NULL);
+
+    if ((error = pthread_create(&reader, NULL, filter_reader, &ctx)) != 0) {
+        fprintf(stderr, "Failed to start reader: %s\n", strerror(error));
+    } else {
+        error = filter_writer(&ctx);
+        pthread_join(reader, NULL);
+        if (error == 0) {
+            error = ctx.error;
+        }
+    }
+
+    if (error != 0) {
+        fprintf(stderr, "Filter failed: %s\n", strerror(error));
+    }
+
+    pthread_cond_destroy(&ctx.freed_cv);
+    pthread_cond_destroy(&ctx.filled_cv);
+    pthread_mutex_destroy(&ctx.lock);
+
+    for (int i = 0; i < FILTER_NBUF; ++i) {
+        munmap(ctx.ring[i].data, ctx.chunk_size);
+    }
+
+    return error;
+}
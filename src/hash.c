@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2023-2024 Ian Marco Moffett and the Osmora team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Osmora nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fileio.h>
+#include <hash.h>
+
+#define HASH_MUL    0x9E3779B97F4A7C15ULL
+
+static inline uint64_t
+mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/*
+ * Fast non-cryptographic 64-bit hash. Four independent lanes keep
+ * the multiplies from serialising.
+ */
+uint64_t
+hash64(const void *buf, size_t len, uint64_t seed)
+{
+    const unsigned char *p = buf;
+    uint64_t lane[4] = { seed, seed ^ HASH_MUL, seed + HASH_MUL, ~seed };
+    uint64_t w, h;
+    size_t i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        for (int j = 0; j < 4; ++j) {
+            memcpy(&w, p + i + j * 8, sizeof(w));
+            lane[j] = (lane[j] ^ w) * HASH_MUL;
+            lane[j] ^= lane[j] >> 31;
+        }
+    }
+
+    h = mix(lane[0]) ^ mix(lane[1] + 1) ^ mix(lane[2] + 2) ^ mix(lane[3] + 3);
+    for (; i < len; ++i) {
+        h = (h ^ p[i]) * HASH_MUL;
+    }
+
+    return mix(h ^ len);
+}
+
+/*
+ * Hash of the chunk at `off' (HASH_CHUNK aligned, at most HASH_CHUNK
+ * long) as it contributes to its file's hash.
+ */
+uint64_t
+hash_chunk(const void *buf, size_t len, off_t off)
+{
+    return hash64(buf, len, off / HASH_CHUNK + 1);
+}
+
+/*
+ * Hash the whole of `fd' through `buf' (HASH_CHUNK bytes).
+ */
+int
+hash_fd(int fd, char *buf, uint64_t *hash_out)
+{
+    uint64_t hash = 0;
+    ssize_t n;
+    off_t off = 0;
+
+    while ((n = pread_full(fd, buf, HASH_CHUNK, off)) > 0) {
+        hash += hash_chunk(buf, n, off);
+        off += n;
+    }
+
+    if (n < 0) {
+        return -1;
+    }
+
+    *hash_out = hash;
+    return 0;
+}
@@ -0,0 +1,263 @@
+/*
+ * Copyright (c) 2023-2024 Ian Marco Moffett and the Osmora team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Osmora nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/stat.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <encrypt.h>
+#include <fileio.h>
+#include <journal.h>
+#include <inplace.h>
+#include <stats.h>
+#include <sparse.h>
+
+/*
+ * Invert a file of at most INPLACE_SMALL_MAX bytes through a stack
+ * buffer: one pread(), one pwrite() on the caller's O_RDWR fd, no
+ * stdio and no second open.
+ */
+int
+inplace_small(const struct cpu_info *info, int fd, const char *fname,
+              size_t size)
+{
+    char buf[INPLACE_SMALL_MAX] __attribute__((aligned(64)));
+    uint64_t start;
+    ssize_t n;
+
+    start = stats_begin();
+    n = pread_full(fd, buf, size, 0);
+    if (n < 0) {
+        fprintf(stderr, "%s: read failed: %s\n", fname, strerror(errno));
+        return -1;
+    }
+    stats_end(STATS_READ, start, n);
+
+    encrypt(info, buf, n);
+
+    start = stats_begin();
+    if (pwrite_full(fd, buf, n, 0) != 0) {
+        fprintf(stderr, "%s: write failed: %s\n", fname, strerror(errno));
+        return -1;
+    }
+    stats_end(STATS_WRITE, start, n);
+
+    return 0;
+}
+
+/*
+ * Finish the chunk that was being written when the last run died.
+ * Pages that still hold original data are inverted, pages that were
+ * already written are left alone. In a sparse file holes within the
+ * chunk were never written and still are not.
+ */
+static int
+recover_pending(const struct cpu_info *info, struct journal *jp, int fd,
+                const char *fname, char *buf, bool sparse)
+{
+    off_t off = jp->rec.committed;
+    size_t len = jp->rec.pending_len;
+    size_t page_len;
+    char *page;
+
+    if (pread_full(fd, buf, len, off) != (ssize_t)len) {
+        fprintf(stderr, "%s: read failed: %s\n", fname, strerror(errno));
+        return -1;
+    }
+
+    for (size_t i = 0; i * JOURNAL_PAGE < len; ++i) {
+        page = buf + i * JOURNAL_PAGE;
+        page_len = len - i * JOURNAL_PAGE;
+        if (page_len > JOURNAL_PAGE) {
+            page_len = JOURNAL_PAGE;
+        }
+
+        switch (journal_page_state(jp, i, page, page_len)) {
+        case JOURNAL_PAGE_ORIG:
+            if (sparse) {
+                if (sparse_invert_buf(info, fd, page, off + i * JOURNAL_PAGE,
+                                      page_len, true) != 0) {
+                    fprintf(stderr, "%s: write failed: %s\n", fname,
+                            strerror(errno));
+                    return -1;
+                }
+                break;
+            }
+            encrypt_fixed(info, page, page_len);
+            if (pwrite_full(fd, page, page_len, off + i * JOURNAL_PAGE) != 0) {
+                fprintf(stderr, "%s: write failed: %s\n", fname,
+                        strerror(errno));
+                return -1;
+            }
+            break;
+        case JOURNAL_PAGE_DONE:
+            break;
+        default:
+            fprintf(stderr, "%s: torn page at offset %jd, cannot resume\n",
+                    fname, (intmax_t)(off + i * JOURNAL_PAGE));
+            return -1;
+        }
+    }
+
+    if (fdatasync(fd) != 0) {
+        fprintf(stderr, "%s: sync failed: %s\n", fname, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Invert `fname' in place, JOURNAL_CHUNK bytes at a time, keeping a
+ * journal next to it so an interrupted run picks up where it left
+ * off instead of flipping finished chunks back.
+ */
+int
+inplace_resumable(const struct cpu_info *info, const char *fname)
+{
+    struct journal j;
+    struct io_stream ios;
+    struct stat st;
+    char *buf;
+    bool sparse;
+    off_t off, data, data_end;
+    size_t len;
+    uint64_t start;
+    int fd, resumed, r, error = -1;
+
+    fd = open(fname, O_RDWR);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (sparse_check(fd, &st, fname) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    sparse = sparse_file(&st);
+    buf = malloc(JOURNAL_CHUNK);
+    if (buf == NULL) {
+        fprintf(stderr, "Failed to allocate chunk buffer\n");
+        close(fd);
+        return -1;
+    }
+
+    resumed = journal_open(&j, fname, &st);
+    if (resumed < 0) {
+        goto done;
+    }
+
+    off = j.rec.committed;
+    if (resumed) {
+        fprintf(stderr, "%s: resuming at offset %jd\n", fname, (intmax_t)off);
+        if (j.rec.pending_len != 0) {
+            if (recover_pending(info, &j, fd, fname, buf, sparse) != 0) {
+                journal_close(&j);
+                goto done;
+            }
+            off += j.rec.pending_len;
+        }
+    }
+
+    io_stream_init(&ios, fd, off, st.st_size - off,
+                   st.st_size >= (off_t)IO_SMOOTH_MIN);
+    while (off < st.st_size) {
+        len = st.st_size - off;
+        if (len > JOURNAL_CHUNK) {
+            len = JOURNAL_CHUNK;
+        }
+
+        /* All hole: nothing to do, nothing to journal */
+        if (sparse && sparse_next_data(fd, off, off + len, &data,
+                                       &data_end) == 0) {
+            off += len;
+            continue;
+        }
+
+        start = stats_begin();
+        if (pread_full(fd, buf, len, off) != (ssize_t)len) {
+            fprintf(stderr, "%s: read failed: %s\n", fname, strerror(errno));
+            journal_close(&j);
+            goto done;
+        }
+        stats_end(STATS_READ, start, len);
+
+        start = stats_begin();
+        if (journal_intent(&j, off, buf, len) != 0) {
+            journal_close(&j);
+            goto done;
+        }
+        stats_end(STATS_WRITE, start, 0);
+
+        if (sparse) {
+            /* Accounts its own writes */
+            r = sparse_invert_buf(info, fd, buf, off, len, true);
+        } else {
+            encrypt_fixed(info, buf, len);
+
+            start = stats_begin();
+            r = pwrite_full(fd, buf, len, off);
+            stats_end(STATS_WRITE, start, len);
+        }
+
+        start = stats_begin();
+        if (r != 0 || fdatasync(fd) != 0) {
+            fprintf(stderr, "%s: write failed: %s\n", fname, strerror(errno));
+            journal_close(&j);
+            goto done;
+        }
+        stats_end(STATS_WRITE, start, 0);
+
+        /* Clean after fdatasync(), so it can leave the cache right away */
+        io_stream_read(&ios, off, len);
+        off += len;
+    }
+
+    journal_finish(&j);
+    if (sparse) {
+        sparse_mark(fd, !sparse_marked(fd));
+    }
+    error = 0;
+done:
+    free(buf);
+    close(fd);
+    return error;
+}
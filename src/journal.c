@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2023-2024 Ian Marco Moffett and the Osmora team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Osmora nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Sidecar progress journal for resumable in-place processing.
+ *
+ * Inverting is its own inverse, so re-running over a chunk that was
+ * already done silently undoes it. Before a chunk is overwritten we
+ * durably record which chunk it is and a checksum of each of its
+ * original pages. After a crash every page of that chunk either
+ * still matches its checksum (not written yet), matches once
+ * inverted (written), or neither (torn, reported as an error).
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <fileio.h>
+#include <journal.h>
+
+_Static_assert(sizeof(struct journal_rec) <= JOURNAL_SLOT,
+               "journal record does not fit in a slot");
+
+static uint32_t
+page_sum(const char *p, size_t len, uint64_t mask)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    uint64_t w;
+    size_t i;
+
+    for (i = 0; i + sizeof(w) <= len; i += sizeof(w)) {
+        memcpy(&w, p + i, sizeof(w));
+        h = (h ^ (w ^ mask)) * 0x100000001b3ULL;
+        h ^= h >> 29;
+    }
+    for (; i < len; ++i) {
+        h = (h ^ (uint8_t)(p[i] ^ mask)) * 0x100000001b3ULL;
+    }
+
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+static uint32_t
+rec_sum(const struct journal_rec *rec)
+{
+    return page_sum((const char *)rec, offsetof(struct journal_rec, rec_sum), 0);
+}
+
+static int
+journal_write(struct journal *jp)
+{
+    off_t slot;
+    ssize_t n;
+
+    ++jp->rec.seq;
+    jp->rec.rec_sum = rec_sum(&jp->rec);
+    slot = (jp->rec.seq & 1) * JOURNAL_SLOT;
+
+    n = pwrite(jp->fd, &jp->rec, sizeof(jp->rec), slot);
+    if (n != sizeof(jp->rec) || fdatasync(jp->fd) != 0) {
+        fprintf(stderr, "%s: journal write failed: %s\n", jp->path,
+                strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Load the newest valid slot of an existing journal.
+ * Returns 1 if one was found, 0 otherwise.
+ */
+static int
+journal_load(struct journal *jp)
+{
+    struct journal_rec rec;
+    bool found = false;
+
+    for (int i = 0; i < 2; ++i) {
+        if (pread(jp->fd, &rec, sizeof(rec), i * JOURNAL_SLOT) != sizeof(rec)) {
+            continue;
+        }
+        if (rec.magic != JOURNAL_MAGIC || rec.version != JOURNAL_VERSION) {
+            continue;
+        }
+        if (rec.rec_sum != rec_sum(&rec)) {
+            continue;
+        }
+        if (!found || rec.seq > jp->rec.seq) {
+            jp->rec = rec;
+            found = true;
+        }
+    }
+
+    return found;
+}
+
+/*
+ * Open (or create) the journal for `fname'. Returns 1 if an earlier
+ * run is being resumed, 0 for a fresh start and -1 on error, which
+ * includes a journal that belongs to a different file.
+ */
+int
+journal_open(struct journal *jp, const char *fname, const struct stat *st)
+{
+    const struct journal_rec *rec = &jp->rec;
+
+    memset(&jp->rec, 0, sizeof(jp->rec));
+    jp->fd = -1;
+    if (sidecar_path(jp->path, sizeof(jp->path), fname, JOURNAL_SUFFIX) != 0) {
+        fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+        return -1;
+    }
+
+    jp->fd = open(jp->path, O_RDWR | O_CREAT, 0600);
+    if (jp->fd < 0) {
+        fprintf(stderr, "%s: %s\n", jp->path, strerror(errno));
+        return -1;
+    }
+
+    if (journal_load(jp)) {
+        if (rec->dev != (uint64_t)st->st_dev ||
+            rec->ino != (uint64_t)st->st_ino ||
+            rec->size != (uint64_t)st->st_size ||
+            rec->chunk_size != JOURNAL_CHUNK) {
+            fprintf(stderr, "%s: journal does not match %s, remove it to "
+                    "start over\n", jp->path, fname);
+            journal_close(jp);
+            return -1;
+        }
+        return 1;
+    }
+
+    jp->rec.magic = JOURNAL_MAGIC;
+    jp->rec.version = JOURNAL_VERSION;
+    jp->rec.dev = st->st_dev;
+    jp->rec.ino = st->st_ino;
+    jp->rec.size = st->st_size;
+    jp->rec.chunk_size = JOURNAL_CHUNK;
+
+    /*
+     * The journal's name must be durable before any data is written,
+     * or a crash could leave a half-inverted file with no journal.
+     */
+    if (sync_parent(jp->path) != 0) {
+        fprintf(stderr, "%s: fsync of directory failed: %s\n", jp->path,
+                strerror(errno));
+        journal_close(jp);
+        return -1;
+    }
+
+    if (journal_write(jp) != 0) {
+        journal_close(jp);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Record that the `len' byte chunk at `off', whose original contents
+ * are in `buf', is about to be overwritten. This also commits every
+ * byte before `off', so the data of the previous chunk must already
+ * be synced.
+ */
+int
+journal_intent(struct journal *jp, off_t off, const char *buf, size_t len)
+{
+    size_t page_len;
+
+    jp->rec.committed = off;
+    jp->rec.pending_len = len;
+    memset(jp->rec.page_sum, 0, sizeof(jp->rec.page_sum));
+
+    for (size_t i = 0; i * JOURNAL_PAGE < len; ++i) {
+        page_len = len - i * JOURNAL_PAGE;
+        if (page_len > JOURNAL_PAGE) {
+            page_len = JOURNAL_PAGE;
+        }
+        jp->rec.page_sum[i] = page_sum(buf + i * JOURNAL_PAGE, page_len, 0);
+    }
+
+    return journal_write(jp);
+}
+
+/*
+ * Classify page `idx' of the pending chunk given its current
+ * contents. See JOURNAL_PAGE_*.
+ */
+int
+journal_page_state(const struct journal *jp, size_t idx, const char *page,
+                   size_t len)
+{
+    uint32_t want = jp->rec.page_sum[idx];
+
+    if (page_sum(page, len, 0) == want) {
+        return JOURNAL_PAGE_ORIG;
+    }
+    if (page_sum(page, len, ~0ULL) == want) {
+        return JOURNAL_PAGE_DONE;
+    }
+
+    return JOURNAL_PAGE_TORN;
+}
+
+/*
+ * The whole file is done and synced, drop the journal.
+ */
+void
+journal_finish(struct journal *jp)
+{
+    unlink(jp->path);
+    journal_close(jp);
+}
+
+void
+journal_close(struct journal *jp)
+{
+    if (jp->fd >= 0) {
+        close(jp->fd);
+        jp->fd = -1;
+    }
+}
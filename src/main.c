@@ -27,203 +27,520 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <sys/stat.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
 #include <assert.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <info.h>
-#if defined(__x86_64__)
-#include <accel.h>
-#endif  /* defined(__x86_64__) */
+#include <encrypt.h>
+#include <filter.h>
+#include <fileio.h>
+#include <journal.h>
+#include <inplace.h>
+#include <stats.h>
+#include <perf.h>
+#include <tune.h>
+#include <parallel.h>
+#include <batch.h>
+#include <sparse.h>
+#include <copy.h>
+#include <blkdev.h>
+#include <daemon.h>
+#include <shmring.h>
+#include <order.h>
+#include <manifest.h>
+#include <budget.h>
 
 #if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
 #error "Big endian machines not supported yet"
 #endif
 
-#if defined(__x86_64__)
-#define cpuid(level, a, b, c, d)					\
-  __asm__ __volatile__ ("cpuid\n\t"					\
-			: "=a" (a), "=b" (b), "=c" (c), "=d" (d)	\
-			: "0" (level))
-#endif
-
-#define flip_block(TMP_VAR, TYPE, BUF, POS)         \
-        TMP_VAR = *(TYPE *)&BUF[POS];               \
-        TMP_VAR = ~TMP_VAR;                         \
-        *(TYPE *)&BUF[POS] = TMP_VAR;               \
-
-static char *
-read_file(const char *fname, size_t *size_out)
-{
-    FILE *fp;
-    char *buf;
-    size_t bufsize;
-
-    if (access(fname, F_OK) != 0) {
-        fprintf(stderr, "%s does not exist!\n", fname);
-        return NULL;
-    }
-
-    fp = fopen(fname, "r");
-
-    /* Get file size */
-    fseek(fp, 0, SEEK_END);
-    bufsize = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-
-    buf = malloc(bufsize);
-    fread(buf, sizeof(char), bufsize, fp);
-    fclose(fp);
-
-    *size_out = bufsize;
-
-    return buf;
-}
+/* Long-only options */
+#define OPT_STATS   0x100
+#define OPT_PERF    0x101
+#define OPT_TUNE    0x102
+#define OPT_INCLUDE 0x103
+#define OPT_EXCLUDE 0x104
+#define OPT_MINSIZE 0x105
+#define OPT_MAXSIZE 0x106
+#define OPT_NEWER   0x107
+#define OPT_OLDER   0x108
+#define OPT_MANIFEST 0x109
+#define OPT_VERIFY  0x10a
+#define OPT_DAEMON  0x10b
+#define OPT_CONNECT 0x10c
+#define OPT_FILES   0x10d
+#define OPT_MAXMEM  0x10e
+
+static const struct option long_opts[] = {
+    { "atomic",     no_argument,        NULL, 'a' },
+    { "resumable",  no_argument,        NULL, 'r' },
+    { "output",     required_argument,  NULL, 'o' },
+    { "stats",      optional_argument,  NULL, OPT_STATS },
+    { "perf",       optional_argument,  NULL, OPT_PERF },
+    { "threads",    required_argument,  NULL, 'j' },
+    { "verbose",    no_argument,        NULL, 'v' },
+    { "autotune",   no_argument,        NULL, OPT_TUNE },
+    { "recursive",  no_argument,        NULL, 'R' },
+    { "include",    required_argument,  NULL, OPT_INCLUDE },
+    { "exclude",    required_argument,  NULL, OPT_EXCLUDE },
+    { "min-size",   required_argument,  NULL, OPT_MINSIZE },
+    { "max-size",   required_argument,  NULL, OPT_MAXSIZE },
+    { "newer",      required_argument,  NULL, OPT_NEWER },
+    { "older",      required_argument,  NULL, OPT_OLDER },
+    { "manifest",   required_argument,  NULL, OPT_MANIFEST },
+    { "manifest-verify", no_argument,   NULL, OPT_VERIFY },
+    { "daemon",     required_argument,  NULL, OPT_DAEMON },
+    { "connect",    required_argument,  NULL, OPT_CONNECT },
+    { "files-from", required_argument,  NULL, OPT_FILES },
+    { "null",       no_argument,        NULL, '0' },
+    { "max-mem",    required_argument,  NULL, OPT_MAXMEM },
+    { NULL,         0,                  NULL, 0 }
+};
 
 static void
-writeback_file(const char *fname, const char *buf, size_t buf_size)
+usage(const char *argv0)
 {
-    FILE *fp;
-
-    fp = fopen(fname, "w");
-    fwrite(buf, buf_size, sizeof(char), fp);
-    fclose(fp);
+    fprintf(stderr,
+            "Usage: %s [options] <file... | ->\n"
+            "  -a, --atomic      Replace the file atomically (write to temp, "
+            "then rename)\n"
+            "  -r, --resumable   Resumable in-place mode, journaled in "
+            SIDECAR_PREFIX "<file>" JOURNAL_SUFFIX "\n"
+            "  -o, --output FILE Write the result to FILE, leaving the input "
+            "alone\n"
+            "  --stats[=json]    Report per-phase timing and throughput on "
+            "stderr\n"
+            "  --perf[=json]     Report hardware counters of the invert loop "
+            "on stderr\n"
+            "  -j, --threads N   Use N threads or batch workers (overrides the "
+            "profile)\n"
+            "  -v, --verbose     Report detected CPU features\n"
+            "  -R, --recursive   Process directories recursively\n"
+            "  --include GLOB    With -R, only process files named GLOB\n"
+            "  --exclude GLOB    With -R, skip files and directories named GLOB\n"
+            "  --min-size SIZE   With -R, skip files smaller than SIZE\n"
+            "  --max-size SIZE   With -R, skip files larger than SIZE\n"
+            "  --newer EPOCH     With -R, only files modified after EPOCH\n"
+            "  --older EPOCH     With -R, only files modified before EPOCH\n"
+            "  --files-from LIST Also process the paths listed in LIST (- for "
+            "stdin)\n"
+            "  -0, --null        LIST is NUL-separated, not one path per line\n"
+            "  --manifest FILE   Skip files unchanged since the run that wrote "
+            "FILE\n"
+            "  --manifest-verify With --manifest, also compare content hashes\n"
+            "  --max-mem SIZE    Keep file buffers within SIZE bytes\n"
+            "  --autotune        Benchmark this host and save a tuning profile\n"
+            "  --daemon SOCKET   Serve requests on a Unix socket\n"
+            "  --connect SOCKET  Have the daemon on SOCKET process the files\n"
+            "  -                 Filter stdin to stdout\n",
+            argv0);
 }
 
-#if defined(__x86_64__)
-static inline bool
-is_sse3_supported(void)
+/*
+ * Parse a byte count with an optional K, M, G or T suffix.
+ * Returns -1 on malformed input.
+ */
+static off_t
+parse_size(const char *str)
 {
-    uint32_t ecx, unused;
+    unsigned long long val;
+    char *end;
 
-    cpuid(0x0000001, unused, unused, ecx, unused);
-    return (ecx & (1 << 0)) != 0;
-}
+    errno = 0;
+    val = strtoull(str, &end, 10);
+    if (errno != 0 || end == str) {
+        return -1;
+    }
 
-static inline bool
-is_sse2_supported(void)
-{
-    uint32_t edx, unused;
-    cpuid(0x0000001, unused, unused, unused, edx);
-    return (edx & (1 << 26)) != 0;
-}
+    switch (*end) {
+    case 'T': case 't':
+        val <<= 10;
+        /* Fallthrough */
+    case 'G': case 'g':
+        val <<= 10;
+        /* Fallthrough */
+    case 'M': case 'm':
+        val <<= 10;
+        /* Fallthrough */
+    case 'K': case 'k':
+        val <<= 10;
+        ++end;
+        break;
+    }
 
-static inline bool
-is_avx_supported(void)
-{
-    uint32_t ecx, unused;
-    cpuid(0x0000001, unused, unused, ecx, unused);
-    return (ecx & (1 << 28)) != 0;
+    return (*end == '\0') ? (off_t)val : -1;
 }
 
-static void
-amd64_cpu_tests(struct cpu_info *info)
+/*
+ * Fit the run into `max_mem' bytes. Each worker holds a scratch
+ * buffer and a chunk in flight for the whole run; drop workers until
+ * those take at most half the budget, and reserve them. The rest is
+ * for staging whole files (see budget.c). A budget too small for
+ * even one worker cannot be kept and is refused.
+ */
+static int
+limit_memory(size_t max_mem)
 {
-    bool sse3_supported;
-
-    sse3_supported = false;
+    size_t per_thread = BATCH_CHUNK;
 
-    if (is_sse3_supported()) {
-        printf("[?]: SSE3 supported, may use as optimization\n");
-        sse3_supported = true;
-        info->has_sse3 = 1;
+    per_thread += (g_tune.chunk_size > SPARSE_CHUNK) ? g_tune.chunk_size :
+        SPARSE_CHUNK;
+    while (g_tune.threads > 1 &&
+           (size_t)g_tune.threads * per_thread > max_mem / 2) {
+        --g_tune.threads;
     }
 
-    if (!sse3_supported) {
-        if (is_sse2_supported()) {
-            printf("[?]: SSE2 supported, may use as optimization\n");
-            info->has_sse2 = 1;
-        }
+    if (max_mem < per_thread) {
+        fprintf(stderr, "--max-mem: at least %zu bytes are needed for one "
+                "worker's buffers\n", per_thread);
+        return -1;
     }
 
-    if (is_avx_supported()) {
-        printf("[?]: AVX supported, may use as optimization\n");
-        info->has_avx = 1;
-    }
+    budget_init(max_mem);
+    budget_reserve((size_t)g_tune.threads * per_thread);
+    return 0;
 }
-#endif  /* defined(__x86_64__) */
 
-static char *
-encrypt(const struct cpu_info *info, char *buf, size_t buf_size)
+static int
+process_file(const struct cpu_info *info, const char *fname, bool atomic)
 {
-    size_t current_pos;
-    size_t step;
-    uint64_t tmp;
+    size_t buf_size;
+    char *buf;
+    uint64_t start;
+    struct stat st;
+    int fd, error = 0;
 
-    current_pos = 0;
-    step = 8;           /* Start at 8 bytes (64 bits) */
+    if (atomic) {
+        return atomic_invert(info, fname, g_tune.threads);
+    }
 
-#if defined(__x86_64__)
-    if (info->has_sse2 || info->has_sse3) {
-        step = 16;         /* Start at 16 bytes (128 bits) */
+    /*
+     * Small files are the common case in big batches; handle them
+     * on a single fd without stdio.
+     */
+    fd = open(fname, O_RDWR);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            fprintf(stderr, "%s does not exist!\n", fname);
+        } else {
+            fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+        }
+        return -1;
+    }
+    if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (sparse_check(fd, &st, fname) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (sparse_file(&st)) {
+        /* Only touch the data extents; holes stay holes */
+        error = sparse_invert_file(info, fd, fname, st.st_size);
+        if (error == 0) {
+            sparse_mark(fd, !sparse_marked(fd));
+        }
+        close(fd);
+        return error;
+    }
+    if (S_ISREG(st.st_mode) && (size_t)st.st_size <= INPLACE_SMALL_MAX) {
+        error = inplace_small(info, fd, fname, st.st_size);
+        close(fd);
+        return error;
     }
-    if (info->has_avx) {
-        step = 32;
+    close(fd);
+
+    if (S_ISREG(st.st_mode) &&
+        (g_tune.threads > 1 || !budget_fits(st.st_size))) {
+        /*
+         * Each worker preads and pwrites its own range, no staging;
+         * with one worker that is simply streaming the file.
+         */
+        return parallel_inplace(info, fname, st.st_size, g_tune.threads,
+                                0);
     }
-#endif  /* defined(__x86_64__) */
 
-    while (current_pos < buf_size) {
-        /* Ensure we aren't over 16 bytes and a power of two */
-        if (step != 1) {
-            assert((step & 1) == 0 && step <= 32);
+    budget_acquire(st.st_size);
+    start = stats_begin();
+    buf = read_file(fname, st.st_size, &buf_size);
+    if (buf == NULL) {
+        budget_release(st.st_size);
+        if (errno == EFBIG && stat(fname, &st) == 0) {
+            /* Grew past what we budgeted for; stream it instead */
+            return parallel_inplace(info, fname, st.st_size, 1, 0);
         }
+        return -1;
+    }
+    stats_end(STATS_READ, start, buf_size);
+
+    encrypt(info, buf, buf_size);
+
+    start = stats_begin();
+    error = writeback_file(fname, buf, buf_size);
+    stats_end(STATS_WRITE, start, buf_size);
 
-        /* Ensure we don't cause any overflows */
-        while (((current_pos + step) >= buf_size) && step > 1)
-            /* Essentially divide the step by 2, just faster */
-            step >>= 1;
+    free(buf);
+    budget_release(st.st_size);
+    return error;
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *fname;
+    bool atomic = false;
+    bool resumable = false;
+    bool autotune = false;
+    bool verbose = false;
+    int threads = 0;
+    bool recursive = false;
+    const char *output = NULL;
+    const char *daemon_sock = NULL;
+    const char *connect_sock = NULL;
+    const char *files_from = NULL;
+    off_t max_mem = 0;
+    bool nul = false;
+    char **paths;
+    size_t npaths;
+    const char *manifest = NULL;
+    bool manifest_verify = false;
+    struct walk_filter filter = { 0 };
+    struct stat st;
+    uint64_t start;
+    int c, error;
+    off_t size;
+    struct cpu_info info = { 0 };
 
-        switch (step) {
-        case 32:
-            accel_invert256((uintptr_t)buf + current_pos);
+    while ((c = getopt_long(argc, argv, "arvRj:o:0", long_opts, NULL)) != -1) {
+        switch (c) {
+        case 'a':
+            atomic = true;
             break;
-        case 16:
-            accel_invert128((uintptr_t)buf + current_pos);
+        case 'r':
+            resumable = true;
             break;
-        case 8:
-            flip_block(tmp, uint64_t, buf, current_pos);
+        case 'v':
+            verbose = true;
             break;
-        case 4:
-            flip_block(tmp, uint32_t, buf, current_pos);
+        case 'o':
+            output = optarg;
             break;
-        case 2:
-            flip_block(tmp, uint16_t, buf, current_pos);
+        case 'j':
+            threads = atoi(optarg);
+            if (threads < 1) {
+                usage(argv[0]);
+                return 1;
+            }
             break;
-        case 1:
-            flip_block(tmp, uint8_t, buf, current_pos);
+        case OPT_TUNE:
+            autotune = true;
             break;
+        case 'R':
+            recursive = true;
+            break;
+        case OPT_INCLUDE:
+        case OPT_EXCLUDE:
+            if (filter.include == NULL) {
+                filter.include = calloc(argc, sizeof(char *));
+                filter.exclude = calloc(argc, sizeof(char *));
+                if (filter.include == NULL || filter.exclude == NULL) {
+                    fprintf(stderr, "Out of memory\n");
+                    return 1;
+                }
+            }
+            if (c == OPT_INCLUDE) {
+                filter.include[filter.ninclude++] = optarg;
+            } else {
+                filter.exclude[filter.nexclude++] = optarg;
+            }
+            break;
+        case OPT_MINSIZE:
+        case OPT_MAXSIZE:
+            if ((size = parse_size(optarg)) < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            if (c == OPT_MINSIZE) {
+                filter.min_size = size;
+            } else {
+                filter.max_size = size;
+            }
+            break;
+        case OPT_MAXMEM:
+            if ((max_mem = parse_size(optarg)) <= 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case OPT_NEWER:
+            filter.newer = strtoll(optarg, NULL, 10);
+            break;
+        case OPT_OLDER:
+            filter.older = strtoll(optarg, NULL, 10);
+            break;
+        case OPT_DAEMON:
+            daemon_sock = optarg;
+            break;
+        case OPT_CONNECT:
+            connect_sock = optarg;
+            break;
+        case OPT_FILES:
+            files_from = optarg;
+            break;
+        case '0':
+            nul = true;
+            break;
+        case OPT_MANIFEST:
+            manifest = optarg;
+            break;
+        case OPT_VERIFY:
+            manifest_verify = true;
+            break;
+        case OPT_STATS:
+            if (optarg != NULL && strcmp(optarg, "json") != 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            stats_init(optarg != NULL);
+            break;
+        case OPT_PERF:
+            if (optarg != NULL && strcmp(optarg, "json") != 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            perf_init(optarg != NULL);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
         }
+    }
 
-        current_pos += step;
+    if (optind >= argc && !autotune && daemon_sock == NULL &&
+        files_from == NULL) {
+        usage(argv[0]);
+        return 1;
     }
-}
 
-int
-main(int argc, const char **argv)
-{
-    size_t buf_size;
-    char *buf;
-    struct cpu_info info = { 0 };
+    paths = &argv[optind];
+    npaths = argc - optind;
+    if (files_from != NULL) {
+        paths = order_read_list(files_from, nul, paths, npaths, &npaths);
+        if (paths == NULL) {
+            return 1;
+        }
+        if (npaths == 0) {
+            return 0;
+        }
+    }
+
+    if (connect_sock != NULL && npaths == 1 && strcmp(paths[0], "-") == 0) {
+        /* Stream through the daemon over shared memory */
+        return shmring_filter(connect_sock, STDIN_FILENO,
+                              STDOUT_FILENO) != 0;
+    }
+
+    if (connect_sock != NULL) {
+        /* The daemon has done the setup already */
+        error = daemon_request(connect_sock, paths, npaths,
+                               atomic ? DAEMON_MODE_ATOMIC :
+                               resumable ? DAEMON_MODE_RESUMABLE :
+                               DAEMON_MODE_INPLACE);
+        return error != 0;
+    }
+
+    start = stats_begin();
+    cpu_detect(&info, verbose);
+    stats_end(STATS_CPU, start, 0);
 
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <file>\n", argv[0]);
+    if (autotune) {
+        return tune_run(&info) != 0;
+    }
+
+    tune_load(&info);
+    if (threads != 0) {
+        g_tune.threads = (threads > ENCRYPT_MAX_THREADS) ?
+            ENCRYPT_MAX_THREADS : threads;
+    }
+    if (max_mem != 0 && limit_memory(max_mem) != 0) {
         return 1;
     }
 
-#if defined(__x86_64__)
-    amd64_cpu_tests(&info);
-#endif  /* __x86_64__ */
+    g_stats.kernel = encrypt_kernel(&info);
+    if (daemon_sock != NULL) {
+        error = daemon_serve(&info, daemon_sock, g_tune.threads);
+        stats_report(stderr);
+        perf_report(stderr);
+        return error != 0;
+    }
 
-    buf = read_file(argv[1], &buf_size);
-    if (buf == NULL) {
+    if (output != NULL && (npaths > 1 || recursive || atomic || resumable ||
+                           manifest != NULL || files_from != NULL ||
+                           strcmp(paths[0], "-") == 0)) {
+        fprintf(stderr, "-o takes a single input file and no -a, -r, -R, "
+                "--manifest or --files-from\n");
         return 1;
     }
 
-    encrypt(&info, buf, buf_size);
-    writeback_file(argv[1], buf, buf_size);
-    free(buf);
+    if (manifest != NULL && manifest_load(manifest, manifest_verify) != 0) {
+        fprintf(stderr, "%s: %s\n", manifest, strerror(errno));
+        return 1;
+    }
 
-    return 0;
+    fname = paths[0];
+    if (npaths == 1 && !recursive && is_sidecar(fname)) {
+        fprintf(stderr, "%s: journal or temporary file, skipped\n", fname);
+        return 1;
+    }
+
+    if (npaths > 1 || recursive || files_from != NULL ||
+        (manifest != NULL && strcmp(fname, "-") != 0)) {
+        /*
+         * Several files or a tree: schedule them across the workers.
+         * The batch path also does the manifest bookkeeping.
+         */
+        struct batch_opts bopts = {
+            .info = &info,
+            .atomic = atomic,
+            .resumable = resumable,
+            .recursive = recursive,
+            .filter = &filter,
+            .nthreads = g_tune.threads
+        };
+
+        error = batch_run(&bopts, paths, npaths);
+    } else if (output != NULL) {
+        error = copy_invert(&info, fname, output);
+    } else if (strcmp(fname, "-") == 0) {
+        /* "-" filters stdin to stdout */
+        error = filter_stream(&info, STDIN_FILENO, STDOUT_FILENO);
+    } else if (stat(fname, &st) == 0 && S_ISBLK(st.st_mode)) {
+        if (atomic || resumable) {
+            fprintf(stderr, "%s: -a and -r do not apply to devices\n", fname);
+            return 1;
+        }
+        error = blkdev_invert(&info, fname, g_tune.threads);
+    } else if (resumable) {
+        error = inplace_resumable(&info, fname);
+    } else {
+        error = process_file(&info, fname, atomic);
+    }
+
+    if (manifest_save() != 0) {
+        error = -1;
+    }
+
+    stats_report(stderr);
+    perf_report(stderr);
+    return error != 0;
 }
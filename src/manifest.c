@@ -0,0 +1,473 @@
+/*
+ * Copyright (c) 2023-2024 Ian Marco Moffett and the Osmora team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Osmora nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Incremental-run manifest.
+ *
+ * For every file processed we remember its path, inode, size, mtime
+ * and content hash as they were right after we wrote it. A later run
+ * with the same manifest skips files whose metadata (and with
+ * --manifest-verify, contents) still match: they are already in the
+ * state we left them in. Runtime becomes proportional to what
+ * changed rather than to the size of the tree.
+ *
+ * On disk it is a text file, one file per line:
+ *
+ *   <inode> <size> <mtime sec> <mtime nsec> <hash> <path>
+ *
+ * with backslash and newline in paths escaped as \\ and \n.
+ *
+ * Records made during a run are appended to "<manifest>.log" in the
+ * same format and synced as each file finishes, so a run that is
+ * killed part way still remembers what it inverted (inverting those
+ * files again would flip them back). The log is replayed on load and
+ * folded into the manifest by manifest_save().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <hash.h>
+#include <manifest.h>
+
+#define MANIFEST_HEADER     "# fobfuscate manifest v1"
+#define MANIFEST_INITIAL    1024
+#define MANIFEST_LOG        ".log"
+
+struct manifest_entry {
+    char *path;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    long mtime_nsec;
+    uint64_t hash;
+};
+
+static struct {
+    bool active;
+    bool verify;
+    bool dirty;
+    char *path;
+    char *log_path;
+    int log_fd;
+    struct manifest_entry **slots;
+    size_t cap;             /* Power of two */
+    size_t count;
+    pthread_rwlock_t lock;
+} manifest = { .log_fd = -1, .lock = PTHREAD_RWLOCK_INITIALIZER };
+
+static size_t
+path_slot(const char *path, size_t cap)
+{
+    return hash64(path, strlen(path), 0) & (cap - 1);
+}
+
+static struct manifest_entry **
+lookup(const char *path)
+{
+    size_t i;
+
+    if (manifest.cap == 0) {
+        return NULL;
+    }
+
+    for (i = path_slot(path, manifest.cap); manifest.slots[i] != NULL;
+         i = (i + 1) & (manifest.cap - 1)) {
+        if (strcmp(manifest.slots[i]->path, path) == 0) {
+            return &manifest.slots[i];
+        }
+    }
+
+    return &manifest.slots[i];
+}
+
+static int
+grow(void)
+{
+    struct manifest_entry **old = manifest.slots;
+    size_t old_cap = manifest.cap;
+    size_t i;
+
+    manifest.cap = (old_cap == 0) ? MANIFEST_INITIAL : old_cap * 2;
+    manifest.slots = calloc(manifest.cap, sizeof(*manifest.slots));
+    if (manifest.slots == NULL) {
+        manifest.slots = old;
+        manifest.cap = old_cap;
+        return -1;
+    }
+
+    for (size_t j = 0; j < old_cap; ++j) {
+        if (old[j] == NULL) {
+            continue;
+        }
+        for (i = path_slot(old[j]->path, manifest.cap);
+             manifest.slots[i] != NULL; i = (i + 1) & (manifest.cap - 1));
+        manifest.slots[i] = old[j];
+    }
+
+    free(old);
+    return 0;
+}
+
+/*
+ * Insert or replace; the table takes ownership of `ent'.
+ * Caller holds the write lock.
+ */
+static int
+insert(struct manifest_entry *ent)
+{
+    struct manifest_entry **slot;
+
+    if ((manifest.count + 1) * 10 > manifest.cap * 7 && grow() != 0) {
+        return -1;
+    }
+
+    slot = lookup(ent->path);
+    if (*slot != NULL) {
+        free((*slot)->path);
+        free(*slot);
+    } else {
+        ++manifest.count;
+    }
+
+    *slot = ent;
+    return 0;
+}
+
+static void
+unescape(char *s)
+{
+    char *out = s;
+
+    for (; *s != '\0'; ++s) {
+        if (*s == '\\' && s[1] != '\0') {
+            *out++ = (*++s == 'n') ? '\n' : *s;
+        } else {
+            *out++ = *s;
+        }
+    }
+    *out = '\0';
+}
+
+static void
+write_escaped(FILE *fp, const char *s)
+{
+    for (; *s != '\0'; ++s) {
+        if (*s == '\\') {
+            fputs("\\\\", fp);
+        } else if (*s == '\n') {
+            fputs("\\n", fp);
+        } else {
+            fputc(*s, fp);
+        }
+    }
+}
+
+static void
+write_entry(FILE *fp, const struct manifest_entry *ent)
+{
+    fprintf(fp, "%" PRIu64 " %" PRIu64 " %" PRId64 " %ld %016" PRIx64 " ",
+            ent->ino, ent->size, ent->mtime_sec, ent->mtime_nsec, ent->hash);
+    write_escaped(fp, ent->path);
+    fputc('\n', fp);
+}
+
+/*
+ * Read entries from `path' into the table. A log may end in a record
+ * torn by a crash, so with `complete' set only lines that made it to
+ * their newline are taken. Returns the number of entries read, or -1.
+ */
+static int
+load_file(const char *path, bool complete)
+{
+    struct manifest_entry *ent;
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    int n, nread = 0, lineno = 0;
+    FILE *fp;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        return (errno == ENOENT) ? 0 : -1;
+    }
+
+    while ((len = getline(&line, &line_size, fp)) > 0) {
+        ++lineno;
+        if (line[len - 1] == '\n') {
+            line[--len] = '\0';
+        } else if (complete) {
+            break;
+        }
+        if (line[0] == '#' || line[0] == '\0') {
+            continue;
+        }
+
+        if ((ent = calloc(1, sizeof(*ent))) == NULL) {
+            break;
+        }
+
+        n = 0;
+        if (sscanf(line, "%" SCNu64 " %" SCNu64 " %" SCNd64 " %ld %" SCNx64
+                   " %n", &ent->ino, &ent->size, &ent->mtime_sec,
+                   &ent->mtime_nsec, &ent->hash, &n) != 5 || n == 0) {
+            fprintf(stderr, "%s:%d: malformed entry ignored\n", path, lineno);
+            free(ent);
+            continue;
+        }
+
+        unescape(line + n);
+        if ((ent->path = strdup(line + n)) == NULL || insert(ent) != 0) {
+            free(ent->path);
+            free(ent);
+            break;
+        }
+        ++nread;
+    }
+
+    free(line);
+    fclose(fp);
+    return nread;
+}
+
+/*
+ * Use `path' as the manifest for this run, loading it if it exists
+ * along with the log of a run that did not get to save it.
+ */
+int
+manifest_load(const char *path, bool verify)
+{
+    size_t len = strlen(path);
+    int n;
+
+    manifest.active = true;
+    manifest.verify = verify;
+    manifest.path = strdup(path);
+    manifest.log_path = malloc(len + sizeof(MANIFEST_LOG));
+    if (manifest.path == NULL || manifest.log_path == NULL || grow() != 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(manifest.log_path, path, len);
+    memcpy(manifest.log_path + len, MANIFEST_LOG, sizeof(MANIFEST_LOG));
+
+    if (load_file(path, false) < 0) {
+        return -1;
+    }
+
+    if ((n = load_file(manifest.log_path, true)) < 0) {
+        return -1;
+    }
+    if (n > 0) {
+        /* Fold it in now; new records must not follow a torn line */
+        manifest.dirty = true;
+        if (manifest_save() != 0) {
+            return -1;
+        }
+    }
+
+    manifest.log_fd = open(manifest.log_path, O_WRONLY | O_APPEND | O_CREAT |
+                           O_TRUNC | O_CLOEXEC, 0644);
+    return (manifest.log_fd < 0) ? -1 : 0;
+}
+
+/*
+ * Append `ent' to the log and sync it. O_APPEND keeps concurrent
+ * records from interleaving; a torn last line is dropped on replay.
+ */
+static void
+log_entry(const struct manifest_entry *ent)
+{
+    char *line = NULL;
+    size_t len = 0;
+    FILE *fp;
+
+    if ((fp = open_memstream(&line, &len)) == NULL) {
+        return;
+    }
+    write_entry(fp, ent);
+    if (fclose(fp) != 0) {
+        free(line);
+        return;
+    }
+
+    if (write(manifest.log_fd, line, len) != (ssize_t)len ||
+        fdatasync(manifest.log_fd) != 0) {
+        fprintf(stderr, "%s: %s\n", manifest.log_path, strerror(errno));
+    }
+    free(line);
+}
+
+bool
+manifest_active(void)
+{
+    return manifest.active;
+}
+
+/*
+ * True if `path', described by `st', is exactly as we left it last
+ * time. `buf' (HASH_CHUNK bytes) is used to re-hash its contents
+ * in verify mode.
+ */
+bool
+manifest_unchanged(const char *path, const struct stat *st, char *buf)
+{
+    struct manifest_entry **slot, ent;
+    bool found = false;
+    uint64_t hash;
+    int fd;
+
+    pthread_rwlock_rdlock(&manifest.lock);
+    slot = lookup(path);
+    if (slot != NULL && *slot != NULL) {
+        ent = **slot;
+        found = true;
+    }
+    pthread_rwlock_unlock(&manifest.lock);
+
+    if (!found) {
+        return false;
+    }
+
+    if (ent.ino != (uint64_t)st->st_ino ||
+        ent.size != (uint64_t)st->st_size ||
+        ent.mtime_sec != (int64_t)st->st_mtim.tv_sec ||
+        ent.mtime_nsec != st->st_mtim.tv_nsec) {
+        return false;
+    }
+
+    if (!manifest.verify) {
+        return true;
+    }
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        return false;
+    }
+    found = hash_fd(fd, buf, &hash) == 0 && hash == ent.hash;
+    close(fd);
+    return found;
+}
+
+/*
+ * Remember `path' as just written: `st' taken after the last write,
+ * `hash' the sum of hash_chunk() over its new contents.
+ */
+void
+manifest_record(const char *path, const struct stat *st, uint64_t hash)
+{
+    struct manifest_entry *ent;
+
+    if ((ent = malloc(sizeof(*ent))) == NULL) {
+        return;
+    }
+    if ((ent->path = strdup(path)) == NULL) {
+        free(ent);
+        return;
+    }
+
+    ent->ino = st->st_ino;
+    ent->size = st->st_size;
+    ent->mtime_sec = st->st_mtim.tv_sec;
+    ent->mtime_nsec = st->st_mtim.tv_nsec;
+    ent->hash = hash;
+
+    log_entry(ent);
+
+    pthread_rwlock_wrlock(&manifest.lock);
+    if (insert(ent) != 0) {
+        free(ent->path);
+        free(ent);
+    } else {
+        manifest.dirty = true;
+    }
+    pthread_rwlock_unlock(&manifest.lock);
+}
+
+/*
+ * Write the manifest back (via a temporary and rename, so a crash
+ * never leaves it half written) and drop the log it now covers.
+ */
+int
+manifest_save(void)
+{
+    const struct manifest_entry *ent;
+    char tmp[PATH_MAX];
+    FILE *fp;
+
+    if (!manifest.active) {
+        return 0;
+    }
+    if (!manifest.dirty) {
+        if (manifest.log_fd >= 0) {
+            close(manifest.log_fd);
+            manifest.log_fd = -1;
+        }
+        unlink(manifest.log_path);
+        return 0;
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", manifest.path);
+    if ((fp = fopen(tmp, "w")) == NULL) {
+        fprintf(stderr, "%s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+
+    fprintf(fp, "%s\n", MANIFEST_HEADER);
+    for (size_t i = 0; i < manifest.cap; ++i) {
+        if ((ent = manifest.slots[i]) == NULL) {
+            continue;
+        }
+        write_entry(fp, ent);
+    }
+
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0 || fclose(fp) != 0) {
+        fprintf(stderr, "%s: %s\n", tmp, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+
+    if (rename(tmp, manifest.path) != 0) {
+        fprintf(stderr, "%s: %s\n", manifest.path, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+
+    /* Only now is everything in the log also in the manifest */
+    if (manifest.log_fd >= 0) {
+        close(manifest.log_fd);
+        manifest.log_fd = -1;
+    }
+    unlink(manifest.log_path);
+    return 0;
+}
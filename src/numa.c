@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2023-2024 Ian Marco Moffett and the Osmora team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Osmora nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <numa.h>
+
+#define NODE_SYSFS  "/sys/devices/system/node"
+
+/*
+ * Read a sysfs list such as "0-3,8-11" into `set'.
+ * Returns the number of entries added.
+ */
+static int
+read_list(const char *path, cpu_set_t *set)
+{
+    char buf[4096];
+    char *p, *end;
+    long lo, hi;
+    int count = 0;
+    FILE *fp;
+
+    CPU_ZERO(set);
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        return 0;
+    }
+    if (fgets(buf, sizeof(buf), fp) == NULL) {
+        fclose(fp);
+        return 0;
+    }
+    fclose(fp);
+
+    for (p = buf; *p != '\0' && *p != '\n'; p = end) {
+        lo = strtol(p, &end, 10);
+        if (end == p) {
+            break;
+        }
+        hi = lo;
+        if (*end == '-') {
+            p = end + 1;
+            hi = strtol(p, &end, 10);
+        }
+        for (long i = lo; i <= hi && i < CPU_SETSIZE; ++i) {
+            CPU_SET(i, set);
+            ++count;
+        }
+        if (*end == ',') {
+            ++end;
+        }
+    }
+
+    return count;
+}
+
+void
+numa_probe(struct numa_topo *topo)
+{
+    char path[128];
+    cpu_set_t online;
+
+    topo->nnodes = 0;
+
+    if (read_list(NODE_SYSFS "/online", &online) > 0) {
+        for (int node = 0; node < CPU_SETSIZE; ++node) {
+            if (!CPU_ISSET(node, &online) || topo->nnodes == NUMA_MAX_NODES) {
+                continue;
+            }
+
+            /* Memory-only nodes have nothing to run workers on */
+            snprintf(path, sizeof(path), NODE_SYSFS "/node%d/cpulist", node);
+            if (read_list(path, &topo->cpus[topo->nnodes]) == 0) {
+                continue;
+            }
+            topo->node_id[topo->nnodes++] = node;
+        }
+    }
+
+    if (topo->nnodes == 0) {
+        topo->nnodes = 1;
+        topo->node_id[0] = 0;
+        sched_getaffinity(0, sizeof(topo->cpus[0]), &topo->cpus[0]);
+    }
+}
+
+/*
+ * Restrict the calling thread to the CPUs of node `idx'. Pages it
+ * touches first are then allocated on that node.
+ */
+int
+numa_bind(const struct numa_topo *topo, int idx)
+{
+    if (topo->nnodes <= 1) {
+        return 0;
+    }
+
+    return sched_setaffinity(0, sizeof(topo->cpus[idx]), &topo->cpus[idx]);
+}
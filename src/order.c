@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2023-2024 Ian Marco Moffett and the Osmora team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Osmora nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Input lists and disk-order scheduling for batches.
+ *
+ * Paths given on the command line or in a list usually come in an
+ * order unrelated to where the files sit on disk, so working through
+ * them as given seeks all over the device. Before scheduling, each
+ * file's first physical extent is looked up with FIEMAP and the paths
+ * are sorted by device and physical offset, or by inode number where
+ * the filesystem has no FIEMAP (inode order roughly follows
+ * allocation order on most filesystems, and keeps inode table reads
+ * sequential either way).
+ */
+
+#define _GNU_SOURCE
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <order.h>
+
+struct order_key {
+    bool known;                 /* stat() worked */
+    uint64_t dev;
+    uint64_t phys;              /* First physical byte, or 0 */
+    uint64_t ino;
+    char *path;
+};
+
+/*
+ * Physical offset of the first extent of the file at `path', or 0
+ * if it has none or the filesystem can't tell.
+ */
+static uint64_t
+first_extent(const char *path)
+{
+    /* Room for the header and a single extent */
+    uint64_t buf[(sizeof(struct fiemap) +
+                  sizeof(struct fiemap_extent)) / sizeof(uint64_t)];
+    struct fiemap *map = (struct fiemap *)buf;
+    uint64_t phys = 0;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_NONBLOCK)) < 0) {
+        return 0;
+    }
+
+    memset(buf, 0, sizeof(buf));
+    map->fm_length = FIEMAP_MAX_OFFSET;
+    map->fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, map) == 0 && map->fm_mapped_extents != 0) {
+        phys = map->fm_extents[0].fe_physical;
+    }
+
+    close(fd);
+    return phys;
+}
+
+static int
+key_cmp(const void *a, const void *b)
+{
+    const struct order_key *ka = a, *kb = b;
+
+    if (ka->known != kb->known) {
+        return ka->known ? 1 : -1;
+    }
+    if (ka->dev != kb->dev) {
+        return (ka->dev < kb->dev) ? -1 : 1;
+    }
+    if (ka->phys != kb->phys) {
+        return (ka->phys < kb->phys) ? -1 : 1;
+    }
+    if (ka->ino != kb->ino) {
+        return (ka->ino < kb->ino) ? -1 : 1;
+    }
+    return 0;
+}
+
+/*
+ * Sort `paths' into on-disk order and drop repeats of the same file
+ * (the same path twice, or hard links), which would otherwise be
+ * inverted twice, possibly by two workers at once. This only covers
+ * the listed paths; files found by walking are checked as they are
+ * reached (see batch_seen()). Paths that can't
+ * be stat()'d go first, so their errors show up right away;
+ * directories sort by inode. Returns the new number of paths.
+ */
+size_t
+order_paths(char **paths, size_t npaths)
+{
+    struct order_key *keys;
+    struct stat st;
+    size_t n = 0;
+
+    if (npaths < 2 || (keys = calloc(npaths, sizeof(*keys))) == NULL) {
+        /* Nothing to do, or not worth failing the run over */
+        return npaths;
+    }
+
+    for (size_t i = 0; i < npaths; ++i) {
+        keys[i].path = paths[i];
+        if (stat(paths[i], &st) != 0) {
+            continue;
+        }
+        keys[i].known = true;
+        keys[i].dev = st.st_dev;
+        keys[i].ino = st.st_ino;
+        if (S_ISREG(st.st_mode) && st.st_size > 0) {
+            keys[i].phys = first_extent(paths[i]);
+        }
+    }
+
+    qsort(keys, npaths, sizeof(*keys), key_cmp);
+    for (size_t i = 0; i < npaths; ++i) {
+        if (i > 0 && keys[i].known && keys[i].dev == keys[i - 1].dev &&
+            keys[i].ino == keys[i - 1].ino) {
+            continue;
+        }
+        paths[n++] = keys[i].path;
+    }
+
+    free(keys);
+    return n;
+}
+
+/*
+ * Read the list of paths in `list' ("-" for stdin), one per line or,
+ * with `nul', NUL-separated, and return it appended to `paths'. The
+ * result is a new array (and new strings) of `*count_out' entries
+ * that lives until exit; NULL on error.
+ */
+char **
+order_read_list(const char *list, bool nul, char **paths, size_t npaths,
+                size_t *count_out)
+{
+    char **out, **tmp;
+    char *line = NULL;
+    size_t cap = npaths + 1024, n = 0, line_size = 0;
+    ssize_t len;
+    FILE *fp;
+
+    fp = (strcmp(list, "-") == 0) ? stdin : fopen(list, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "%s: %s\n", list, strerror(errno));
+        return NULL;
+    }
+
+    if ((out = malloc(cap * sizeof(*out))) == NULL) {
+        goto nomem;
+    }
+    for (; n < npaths; ++n) {
+        out[n] = paths[n];
+    }
+
+    while ((len = getdelim(&line, &line_size, nul ? '\0' : '\n', fp)) > 0) {
+        if (line[len - 1] == (nul ? '\0' : '\n')) {
+            line[--len] = '\0';
+        }
+        if (len == 0) {
+            continue;
+        }
+
+        if (n == cap) {
+            cap *= 2;
+            if ((tmp = realloc(out, cap * sizeof(*out))) == NULL) {
+                goto nomem;
+            }
+            out = tmp;
+        }
+        if ((out[n++] = strdup(line)) == NULL) {
+            goto nomem;
+        }
+    }
+
+    if (ferror(fp)) {
+        fprintf(stderr, "%s: %s\n", list, strerror(errno));
+        goto fail;
+    }
+
+    free(line);
+    if (fp != stdin) {
+        fclose(fp);
+    }
+    *count_out = n;
+    return out;
+nomem:
+    fprintf(stderr, "Out of memory reading %s\n", list);
+fail:
+    free(line);
+    free(out);
+    if (fp != stdin) {
+        fclose(fp);
+    }
+    return NULL;
+}
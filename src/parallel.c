@@ -0,0 +1,328 @@
+/*
+ * Copyright (c) 2023-2024 Ian Marco Moffett and the Osmora team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Osmora nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * NUMA-aware parallel load and invert.
+ *
+ * Instead of one thread reading the whole file and the workers then
+ * pulling its pages across the interconnect, each worker is pinned
+ * to a node and reads its own slice of the file straight into the
+ * (not yet touched) buffer. First touch places those pages on the
+ * worker's node, where the worker then inverts them.
+ *
+ * When the file is rewritten in place there is no need for a buffer
+ * holding all of it: each worker opens its own descriptor and runs
+ * pread(), invert, pwrite() over its slice one tuning chunk at a
+ * time, so I/O is submitted from every worker at once and inverting
+ * starts with the first chunk rather than after the whole file.
+ */
+
+#define _GNU_SOURCE
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <encrypt.h>
+#include <fileio.h>
+#include <stats.h>
+#include <tune.h>
+#include <numa.h>
+#include <parallel.h>
+
+struct load_work {
+    const struct cpu_info *info;
+    const struct numa_topo *topo;
+    int node;               /* Index into topo */
+    int fd;
+    const char *fname;      /* In place: opened by each worker */
+    int oflags;             /* Extra open() flags for it */
+    char *buf;              /* Start of this worker's slice, or NULL */
+    off_t off;
+    size_t len;
+    int error;
+};
+
+static void *
+load_worker(void *arg)
+{
+    struct load_work *work = arg;
+    uint64_t start;
+
+    numa_bind(work->topo, work->node);
+
+    start = stats_begin();
+    if (pread_full(work->fd, work->buf, work->len, work->off) !=
+        (ssize_t)work->len) {
+        work->error = (errno != 0) ? errno : EIO;
+        return NULL;
+    }
+    stats_end(STATS_READ, start, work->len);
+
+    encrypt_fixed(work->info, work->buf, work->len);
+    return NULL;
+}
+
+static void *
+inplace_worker(void *arg)
+{
+    struct load_work *work = arg;
+    size_t n, chunk = g_tune.chunk_size;
+    off_t off = work->off, end = work->off + work->len;
+    struct io_stream ios;
+    uint64_t start;
+    char *buf;
+    int fd;
+
+    numa_bind(work->topo, work->node);
+
+    /* Private fd and buffer, both first used on this worker's node */
+    fd = open(work->fname, O_RDWR | work->oflags);
+    if (fd < 0 && errno == EINVAL && (work->oflags & O_DIRECT) != 0) {
+        /* Driver or filesystem without O_DIRECT */
+        work->oflags &= ~O_DIRECT;
+        fd = open(work->fname, O_RDWR | work->oflags);
+    }
+    if (fd < 0) {
+        work->error = errno;
+        return NULL;
+    }
+    /* Page aligned, which covers O_DIRECT's sector alignment */
+    if (posix_memalign((void **)&buf, ENCRYPT_PAGE, chunk) != 0) {
+        work->error = ENOMEM;
+        close(fd);
+        return NULL;
+    }
+
+    io_stream_init(&ios, fd, off, work->len, work->len >= IO_SMOOTH_MIN &&
+                   (work->oflags & O_DIRECT) == 0);
+    for (; off < end; off += n) {
+        n = (end - off > (off_t)chunk) ? chunk : (size_t)(end - off);
+
+        start = stats_begin();
+        if (pread_full(fd, buf, n, off) != (ssize_t)n) {
+            work->error = (errno != 0) ? errno : EIO;
+            break;
+        }
+        stats_end(STATS_READ, start, n);
+
+        encrypt_fixed(work->info, buf, n);
+
+        start = stats_begin();
+        if (pwrite_full(fd, buf, n, off) != 0) {
+            work->error = errno;
+            break;
+        }
+        io_stream_written(&ios, off, n);
+        stats_end(STATS_WRITE, start, n);
+    }
+
+    io_stream_finish(&ios);
+    free(buf);
+    if (close(fd) != 0 && work->error == 0) {
+        work->error = errno;
+    }
+    return NULL;
+}
+
+/*
+ * Cut `size' bytes into at most `nthreads' contiguous slices of whole
+ * tuning chunks (the last one takes the remainder) and fill in
+ * `work'. Returns the number of slices.
+ */
+static int
+plan_slices(struct load_work *work, const struct numa_topo *topo,
+            size_t size, int nthreads)
+{
+    size_t nchunks, per_thread, off = 0;
+
+    if (nthreads > ENCRYPT_MAX_THREADS) {
+        nthreads = ENCRYPT_MAX_THREADS;
+    }
+    nchunks = size / g_tune.chunk_size;
+    if (nchunks < (size_t)nthreads) {
+        nthreads = (nchunks == 0) ? 1 : nchunks;
+    }
+
+    per_thread = (nchunks / nthreads) * g_tune.chunk_size;
+    for (int i = 0; i < nthreads; ++i) {
+        memset(&work[i], 0, sizeof(work[i]));
+        work[i].topo = topo;
+        /* Consecutive slices go to the same node */
+        work[i].node = (int)((long)i * topo->nnodes / nthreads);
+        work[i].off = off;
+        work[i].len = (i == nthreads - 1) ? size - off : per_thread;
+        off += per_thread;
+    }
+
+    return nthreads;
+}
+
+/*
+ * Run `fn' on each of the `n' slices, slice 0 on the calling thread.
+ * Returns the first error any of them hit.
+ */
+static int
+run_slices(void *(*fn)(void *), struct load_work *work, int n)
+{
+    pthread_t threads[ENCRYPT_MAX_THREADS];
+    bool started[ENCRYPT_MAX_THREADS];
+    int i, error = 0;
+
+    for (i = 1; i < n; ++i) {
+        started[i] = pthread_create(&threads[i], NULL, fn, &work[i]) == 0;
+        if (!started[i]) {
+            fn(&work[i]);
+        }
+    }
+
+    /* The calling thread takes slice 0, then gets its mask back */
+    {
+        cpu_set_t saved;
+
+        sched_getaffinity(0, sizeof(saved), &saved);
+        fn(&work[0]);
+        sched_setaffinity(0, sizeof(saved), &saved);
+    }
+
+    for (i = 0; i < n; ++i) {
+        if (i > 0 && started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+        if (work[i].error != 0 && error == 0) {
+            error = work[i].error;
+        }
+    }
+
+    return error;
+}
+
+/*
+ * Read `fname' and invert it using `nthreads' workers spread evenly
+ * over the NUMA nodes, each owning a contiguous slice made of whole
+ * tuning chunks. Returns the inverted contents (free() it) or NULL;
+ * NULL with errno EFBIG if it is now bigger than `max' bytes.
+ */
+char *
+parallel_load(const struct cpu_info *info, const char *fname, size_t max,
+              size_t *size_out, int nthreads)
+{
+    struct load_work work[ENCRYPT_MAX_THREADS];
+    struct numa_topo topo;
+    struct stat st;
+    size_t size;
+    char *buf;
+    int fd, i, error;
+
+    if ((fd = open(fname, O_RDONLY)) < 0) {
+        fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+        return NULL;
+    }
+
+    if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    size = st.st_size;
+    if (size > max) {
+        /* Grew past what the caller budgeted for, see read_file() */
+        close(fd);
+        errno = EFBIG;
+        return NULL;
+    }
+
+    /*
+     * A large malloc() is a fresh mapping, so nothing but its header
+     * page has been touched yet and first touch is left to the
+     * workers.
+     */
+    if ((buf = malloc(size ? size : 1)) == NULL) {
+        fprintf(stderr, "Failed to allocate %zu bytes\n", size);
+        close(fd);
+        return NULL;
+    }
+
+    numa_probe(&topo);
+    nthreads = plan_slices(work, &topo, size, nthreads);
+    for (i = 0; i < nthreads; ++i) {
+        work[i].info = info;
+        work[i].fd = fd;
+        work[i].buf = buf + work[i].off;
+    }
+
+    error = run_slices(load_worker, work, nthreads);
+    close(fd);
+
+    if (error != 0) {
+        fprintf(stderr, "%s: read failed: %s\n", fname, strerror(error));
+        free(buf);
+        return NULL;
+    }
+
+    *size_out = size;
+    return buf;
+}
+
+/*
+ * Invert `fname' in place with `nthreads' workers, each with its own
+ * descriptor (opened with `oflags' added) and chunk buffer working
+ * through its own slice. Slices and chunks start at multiples of the
+ * tuning chunk size, so with O_DIRECT only `size' has to be a
+ * multiple of the device's sector size.
+ */
+int
+parallel_inplace(const struct cpu_info *info, const char *fname,
+                 size_t size, int nthreads, int oflags)
+{
+    struct load_work work[ENCRYPT_MAX_THREADS];
+    struct numa_topo topo;
+    int i, error;
+
+    numa_probe(&topo);
+    nthreads = plan_slices(work, &topo, size, nthreads);
+    for (i = 0; i < nthreads; ++i) {
+        work[i].info = info;
+        work[i].fd = -1;
+        work[i].fname = fname;
+        work[i].oflags = oflags;
+    }
+
+    if ((error = run_slices(inplace_worker, work, nthreads)) != 0) {
+        fprintf(stderr, "%s: %s\n", fname, strerror(error));
+        return -1;
+    }
+
+    return 0;
+}
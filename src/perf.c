@@ -0,0 +1,264 @@
+/*
+ * Copyright (c) 2023-2024 Ian Marco Moffett and the Osmora team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Osmora nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Hardware counter sampling with perf_event_open(2).
+ *
+ * Each thread gets its own counter group (cycles, instructions, LLC
+ * misses and dTLB misses) counting only user space of that thread.
+ * Events the CPU or hypervisor does not expose are left out of the
+ * group and reported as unavailable.
+ */
+
+#define _GNU_SOURCE
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <perf.h>
+
+struct perf_thread {
+    int leader;
+    int nfds;
+    int fds[PERF_NEVENT];
+    int event[PERF_NEVENT];     /* Which PERF_* each group slot counts */
+};
+
+struct perf g_perf;
+
+static pthread_key_t perf_key;
+static pthread_once_t perf_once = PTHREAD_ONCE_INIT;
+
+static const char *event_names[PERF_NEVENT] = {
+    [PERF_CYCLES]       = "cycles",
+    [PERF_INSTR]        = "instructions",
+    [PERF_LLC_MISS]     = "llc_misses",
+    [PERF_DTLB_MISS]    = "dtlb_misses"
+};
+
+static void
+event_attr(int event, struct perf_event_attr *attr)
+{
+    memset(attr, 0, sizeof(*attr));
+    attr->size = sizeof(*attr);
+    attr->exclude_kernel = 1;
+    attr->exclude_hv = 1;
+    attr->read_format = PERF_FORMAT_GROUP;
+
+    switch (event) {
+    case PERF_CYCLES:
+        attr->type = PERF_TYPE_HARDWARE;
+        attr->config = PERF_COUNT_HW_CPU_CYCLES;
+        break;
+    case PERF_INSTR:
+        attr->type = PERF_TYPE_HARDWARE;
+        attr->config = PERF_COUNT_HW_INSTRUCTIONS;
+        break;
+    case PERF_LLC_MISS:
+        attr->type = PERF_TYPE_HARDWARE;
+        attr->config = PERF_COUNT_HW_CACHE_MISSES;
+        break;
+    case PERF_DTLB_MISS:
+        attr->type = PERF_TYPE_HW_CACHE;
+        attr->config = PERF_COUNT_HW_CACHE_DTLB |
+                       (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                       (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        break;
+    }
+}
+
+static void
+perf_thread_free(void *arg)
+{
+    struct perf_thread *pt = arg;
+
+    for (int i = 0; i < pt->nfds; ++i) {
+        close(pt->fds[i]);
+    }
+    free(pt);
+}
+
+static void
+perf_key_init(void)
+{
+    pthread_key_create(&perf_key, perf_thread_free);
+}
+
+static struct perf_thread *
+perf_thread_get(void)
+{
+    struct perf_event_attr attr;
+    struct perf_thread *pt;
+    int fd;
+
+    pthread_once(&perf_once, perf_key_init);
+    pt = pthread_getspecific(perf_key);
+    if (pt != NULL) {
+        return pt;
+    }
+
+    pt = calloc(1, sizeof(*pt));
+    if (pt == NULL) {
+        return NULL;
+    }
+
+    pt->leader = -1;
+    for (int ev = 0; ev < PERF_NEVENT; ++ev) {
+        event_attr(ev, &attr);
+        attr.disabled = (pt->leader < 0);
+        fd = syscall(SYS_perf_event_open, &attr, 0, -1, pt->leader, 0);
+        if (fd < 0) {
+            continue;
+        }
+        if (pt->leader < 0) {
+            pt->leader = fd;
+        }
+        pt->event[pt->nfds] = ev;
+        pt->fds[pt->nfds++] = fd;
+        g_perf.have[ev] = true;
+    }
+
+    if (pt->leader >= 0) {
+        ioctl(pt->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+
+    pthread_setspecific(perf_key, pt);
+    return pt;
+}
+
+/*
+ * Read the calling thread's counters into `out', indexed by PERF_*.
+ */
+static bool
+perf_snapshot(uint64_t *out)
+{
+    struct perf_thread *pt;
+    uint64_t buf[1 + PERF_NEVENT];
+
+    pt = perf_thread_get();
+    if (pt == NULL || pt->leader < 0) {
+        return false;
+    }
+
+    if (read(pt->leader, buf, sizeof(buf)) < (ssize_t)sizeof(uint64_t)) {
+        return false;
+    }
+
+    memset(out, 0, sizeof(uint64_t) * PERF_NEVENT);
+    for (uint64_t i = 0; i < buf[0] && i < (uint64_t)pt->nfds; ++i) {
+        out[pt->event[i]] = buf[1 + i];
+    }
+
+    return true;
+}
+
+void
+perf_init(bool json)
+{
+    g_perf.enabled = true;
+    g_perf.json = json;
+}
+
+void
+perf_read(struct perf_sample *ps)
+{
+    ps->valid = perf_snapshot(ps->start);
+}
+
+void
+perf_end(struct perf_sample *ps, size_t bytes)
+{
+    uint64_t now[PERF_NEVENT];
+
+    if (!ps->valid || !perf_snapshot(now)) {
+        return;
+    }
+
+    for (int i = 0; i < PERF_NEVENT; ++i) {
+        __atomic_fetch_add(&g_perf.count[i], now[i] - ps->start[i],
+                           __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&g_perf.bytes, bytes, __ATOMIC_RELAXED);
+}
+
+void
+perf_report(FILE *fp)
+{
+    double gb;
+
+    if (!g_perf.enabled) {
+        return;
+    }
+
+    gb = g_perf.bytes / 1e9;
+
+    if (g_perf.json) {
+        fprintf(fp, "{\"bytes\":%ju", (uintmax_t)g_perf.bytes);
+        for (int i = 0; i < PERF_NEVENT; ++i) {
+            if (!g_perf.have[i]) {
+                fprintf(fp, ",\"%s\":null,\"%s_per_gb\":null",
+                        event_names[i], event_names[i]);
+                continue;
+            }
+            fprintf(fp, ",\"%s\":%ju,\"%s_per_gb\":%.1f", event_names[i],
+                    (uintmax_t)g_perf.count[i], event_names[i],
+                    (gb > 0) ? g_perf.count[i] / gb : 0.0);
+        }
+        if (g_perf.have[PERF_CYCLES] && g_perf.have[PERF_INSTR] &&
+            g_perf.count[PERF_CYCLES] != 0 && g_perf.bytes != 0) {
+            fprintf(fp, ",\"cycles_per_byte\":%.4f,\"ipc\":%.3f",
+                    (double)g_perf.count[PERF_CYCLES] / g_perf.bytes,
+                    (double)g_perf.count[PERF_INSTR] /
+                    g_perf.count[PERF_CYCLES]);
+        }
+        fprintf(fp, "}\n");
+        return;
+    }
+
+    fprintf(fp, "[perf]: bytes         %ju\n", (uintmax_t)g_perf.bytes);
+    for (int i = 0; i < PERF_NEVENT; ++i) {
+        if (!g_perf.have[i]) {
+            fprintf(fp, "[perf]: %-13s unavailable\n", event_names[i]);
+            continue;
+        }
+        fprintf(fp, "[perf]: %-13s %ju (%.1f per GB)\n", event_names[i],
+                (uintmax_t)g_perf.count[i],
+                (gb > 0) ? g_perf.count[i] / gb : 0.0);
+    }
+    if (g_perf.have[PERF_CYCLES] && g_perf.have[PERF_INSTR] &&
+        g_perf.count[PERF_CYCLES] != 0 && g_perf.bytes != 0) {
+        fprintf(fp, "[perf]: cycles/byte   %.4f\n",
+                (double)g_perf.count[PERF_CYCLES] / g_perf.bytes);
+        fprintf(fp, "[perf]: ipc           %.3f\n",
+                (double)g_perf.count[PERF_INSTR] / g_perf.count[PERF_CYCLES]);
+    }
+}
@@ -0,0 +1,386 @@
+/*
+ * Copyright (c) 2023-2024 Ian Marco Moffett and the Osmora team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Osmora nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <encrypt.h>
+#include <fileio.h>
+#include <daemon.h>
+#include <shmring.h>
+
+/* Polls of a futex word before sleeping on it (with other CPUs) */
+#define SHMRING_SPIN        4096
+
+/* Client slots; the data area is this many times SHMRING_SLOT */
+#define SHMRING_NSLOTS      8
+#define SHMRING_SLOT        (1UL << 20)
+
+/* How often an idle side checks whether the other is still there */
+#define SHMRING_IDLE_MS     200
+
+#define load_acq(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_rel(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define store_sc(p, v)  __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define load_sc(p)      __atomic_load_n((p), __ATOMIC_SEQ_CST)
+
+static inline void
+cpu_relax(void)
+{
+#if defined(__x86_64__)
+    __asm__ __volatile__("pause");
+#endif
+}
+
+/*
+ * Not FUTEX_PRIVATE_FLAG: the words live in memory shared between
+ * processes.
+ */
+static int
+futex_wait(uint32_t *word, uint32_t val, int timeout_ms)
+{
+    struct timespec ts = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = (timeout_ms % 1000) * 1000000L
+    };
+
+    return syscall(SYS_futex, word, FUTEX_WAIT, val,
+                   (timeout_ms < 0) ? NULL : &ts, NULL, 0);
+}
+
+static void
+futex_wake(uint32_t *word)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/*
+ * Wait until `*word' differs from `val'. The waiter announces itself
+ * in `*flag' before sleeping, so the other side knows to wake it; the
+ * store and the re-check are both sequentially consistent, as are the
+ * other side's update of `*word' and its read of `*flag', so one of
+ * the two always sees the other. Returns false on timeout.
+ */
+static bool
+wait_change(uint32_t *word, uint32_t val, uint32_t *flag, int timeout_ms)
+{
+    static int spin = -1;
+    bool changed = true;
+
+    /* On one CPU spinning only delays the side we are waiting for */
+    if (spin < 0) {
+        spin = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? SHMRING_SPIN : 0;
+    }
+
+    for (int i = 0; i < spin; ++i) {
+        if (load_acq(word) != val) {
+            return true;
+        }
+        cpu_relax();
+    }
+
+    store_sc(flag, 1);
+    if (load_sc(word) == val &&
+        futex_wait(word, val, timeout_ms) != 0 && errno == ETIMEDOUT) {
+        changed = load_acq(word) != val;
+    }
+    store_sc(flag, 0);
+    return changed;
+}
+
+/*
+ * Bump `*word' to `val' and wake the other side if it said it sleeps.
+ */
+static void
+publish(uint32_t *word, uint32_t val, uint32_t *flag)
+{
+    store_sc(word, val);
+    if (load_sc(flag)) {
+        futex_wake(word);
+    }
+}
+
+/*
+ * True once the client has hung up the socket.
+ */
+static bool
+peer_gone(int sock)
+{
+    struct pollfd pfd = { .fd = sock, .events = POLLRDHUP };
+
+    return poll(&pfd, 1, 0) > 0 &&
+           (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR)) != 0;
+}
+
+/*
+ * Daemon side: map the ring on `memfd', acknowledge it on `sock' and
+ * serve it until the client closes it or hangs up.
+ */
+int
+shmring_serve(const struct cpu_info *info, int memfd, int sock)
+{
+    struct daemon_reply reply = { .magic = DAEMON_MAGIC };
+    struct shmring *ring = MAP_FAILED;
+    struct stat st;
+    uint32_t tail = 0, nslots = 0;
+    uint64_t off, len, data;
+    size_t size = 0;
+    int seals;
+
+    /*
+     * A ring that can shrink under our mapping would SIGBUS the whole
+     * daemon, so only sealed memfds are taken; anything else has no
+     * seals at all.
+     */
+    seals = fcntl(memfd, F_GET_SEALS);
+    if (seals < 0 || (seals & (F_SEAL_SHRINK | F_SEAL_GROW)) !=
+                     (F_SEAL_SHRINK | F_SEAL_GROW)) {
+        reply.error = EPERM;
+    } else if (fstat(memfd, &st) != 0) {
+        reply.error = errno;
+    } else if ((size_t)st.st_size < sizeof(*ring)) {
+        reply.error = EINVAL;
+    } else {
+        size = st.st_size;
+        ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+        if (ring == MAP_FAILED) {
+            reply.error = errno;
+        } else {
+            /* The client can change these under us; read them once */
+            nslots = load_acq(&ring->nslots);
+            tail = load_acq(&ring->tail);
+            if (ring->magic != SHMRING_MAGIC || nslots == 0 ||
+                nslots > SHMRING_MAX || (nslots & (nslots - 1)) != 0 ||
+                SHMRING_DATA(nslots) > size) {
+                reply.error = EINVAL;
+            }
+        }
+    }
+
+    if (send(sock, &reply, sizeof(reply), MSG_NOSIGNAL) < 0 ||
+        reply.error != 0) {
+        if (ring != MAP_FAILED) {
+            munmap(ring, size);
+        }
+        return -1;
+    }
+
+    data = SHMRING_DATA(nslots);
+    for (;;) {
+        if (load_acq(&ring->head) == tail) {
+            if (load_acq(&ring->closed)) {
+                break;
+            }
+            if (!wait_change(&ring->head, tail, &ring->sleeping,
+                             SHMRING_IDLE_MS) && peer_gone(sock)) {
+                break;
+            }
+            continue;
+        }
+
+        struct shmring_desc *d = &ring->desc[tail & (nslots - 1)];
+
+        off = __atomic_load_n(&d->off, __ATOMIC_RELAXED);
+        len = __atomic_load_n(&d->len, __ATOMIC_RELAXED);
+        if (off < data || off > size || len > size - off) {
+            d->error = EINVAL;
+        } else {
+            encrypt(info, (char *)ring + off, len);
+            d->error = 0;
+        }
+
+        publish(&ring->tail, ++tail, &ring->waiting);
+    }
+
+    munmap(ring, size);
+    return 0;
+}
+
+/*
+ * Client side: filter `in_fd' to `out_fd' through the daemon on
+ * `sock_path' over a shared ring. Up to SHMRING_NSLOTS chunks are in
+ * flight, so reading, inverting and writing overlap.
+ */
+int
+shmring_filter(const char *sock_path, int in_fd, int out_fd)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct daemon_req req = {
+        .magic = DAEMON_MAGIC,
+        .mode = DAEMON_MODE_SHM
+    };
+    struct daemon_reply reply;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctl;
+    struct iovec iov = { &req, offsetof(struct daemon_req, path) + 1 };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = ctl.buf,
+        .msg_controllen = sizeof(ctl.buf)
+    };
+    struct cmsghdr *cmsg;
+    struct shmring *ring;
+    struct shmring_desc *d;
+    size_t data = SHMRING_DATA(SHMRING_NSLOTS);
+    size_t size = data + SHMRING_NSLOTS * SHMRING_SLOT;
+    uint32_t head = 0, done = 0;
+    bool eof = false;
+    ssize_t n;
+    int memfd, sock, error = -1;
+
+    if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: %s\n", sock_path, strerror(ENAMETOOLONG));
+        return -1;
+    }
+    strcpy(addr.sun_path, sock_path);
+
+    memfd = memfd_create("fobfuscate-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd < 0 || ftruncate(memfd, size) != 0 ||
+        fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) != 0) {
+        fprintf(stderr, "memfd: %s\n", strerror(errno));
+        if (memfd >= 0) {
+            close(memfd);
+        }
+        return -1;
+    }
+
+    ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (ring == MAP_FAILED) {
+        fprintf(stderr, "mmap: %s\n", strerror(errno));
+        close(memfd);
+        return -1;
+    }
+    ring->magic = SHMRING_MAGIC;
+    ring->nslots = SHMRING_NSLOTS;
+
+    sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&addr,
+                            sizeof(addr)) != 0) {
+        fprintf(stderr, "%s: %s\n", sock_path, strerror(errno));
+        goto done;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0 ||
+        recv(sock, &reply, sizeof(reply), 0) != sizeof(reply)) {
+        fprintf(stderr, "%s: lost connection to daemon\n", sock_path);
+        goto done;
+    }
+    if (reply.error != 0) {
+        fprintf(stderr, "%s: %s\n", sock_path, strerror(reply.error));
+        goto done;
+    }
+
+    while (!eof || done != head) {
+        /* Fill free slots */
+        while (!eof && head - done < SHMRING_NSLOTS) {
+            d = &ring->desc[head & (SHMRING_NSLOTS - 1)];
+            d->off = data + (head & (SHMRING_NSLOTS - 1)) * SHMRING_SLOT;
+
+            n = read_full(in_fd, (char *)ring + d->off, SHMRING_SLOT);
+            if (n < 0) {
+                fprintf(stderr, "read: %s\n", strerror(errno));
+                goto done;
+            }
+            if (n == 0) {
+                eof = true;
+                break;
+            }
+
+            d->len = n;
+            publish(&ring->head, ++head, &ring->sleeping);
+            if ((size_t)n < SHMRING_SLOT) {
+                eof = true;
+            }
+        }
+
+        /* Drain completed slots in order */
+        while (done != head) {
+            if (load_acq(&ring->tail) == done) {
+                if (head - done < SHMRING_NSLOTS && !eof) {
+                    /* Room to read ahead instead of waiting */
+                    break;
+                }
+                /* The daemon closes the socket if it stops serving us */
+                if (!wait_change(&ring->tail, done, &ring->waiting,
+                                 SHMRING_IDLE_MS) && peer_gone(sock)) {
+                    fprintf(stderr, "%s: lost connection to daemon\n",
+                            sock_path);
+                    goto done;
+                }
+                continue;
+            }
+
+            d = &ring->desc[done & (SHMRING_NSLOTS - 1)];
+            if (d->error != 0) {
+                fprintf(stderr, "%s: %s\n", sock_path, strerror(d->error));
+                goto done;
+            }
+            if (write_full(out_fd, (char *)ring + d->off, d->len) != 0) {
+                fprintf(stderr, "write: %s\n", strerror(errno));
+                goto done;
+            }
+            ++done;
+        }
+    }
+
+    error = 0;
+done:
+    store_sc(&ring->closed, 1);
+    futex_wake(&ring->head);
+    if (sock >= 0) {
+        close(sock);
+    }
+    munmap(ring, size);
+    close(memfd);
+    return error;
+}
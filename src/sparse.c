@@ -0,0 +1,274 @@
+/*
+ * Copyright (c) 2023-2024 Ian Marco Moffett and the Osmora team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Osmora nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Sparse file support.
+ *
+ * Holes are not data: they read back as zeros but occupy no blocks,
+ * and a VM image may be mostly holes. Inverting them would turn every
+ * hole into allocated 0xFF bytes, so the transform is defined as
+ * "invert every data extent, leave holes as holes". It is still its
+ * own inverse, since writing data extents in place does not change
+ * where the holes are, and the work done is proportional to the data
+ * actually allocated. Anything that punches holes into zero blocks
+ * between runs (compressing filesystems, fallocate --dig-holes) breaks
+ * that: an inverted 0xFF block becomes a hole and is never restored.
+ *
+ * Streams (filter mode) have no holes; there zero runs are inverted
+ * like any other bytes. So the result of this transform can only be
+ * undone by it, on the same hole layout. A file left in that state is
+ * tagged with the SPARSE_XATTR extended attribute, and decoding it in
+ * filter mode, or after its holes were lost, is refused (see
+ * sparse_check()). Where xattrs are not supported there is no tag and
+ * no check.
+ */
+
+#define _GNU_SOURCE
+#include <sys/xattr.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <encrypt.h>
+#include <fileio.h>
+#include <stats.h>
+#include <sparse.h>
+
+/*
+ * True if `fd' holds the output of an odd number of hole-preserving
+ * runs.
+ */
+bool
+sparse_marked(int fd)
+{
+    return fgetxattr(fd, SPARSE_XATTR, NULL, 0) >= 0;
+}
+
+/*
+ * Set or clear the tag on `fd'. Filesystems without xattrs simply
+ * go untagged.
+ */
+void
+sparse_mark(int fd, bool on)
+{
+    /* Best effort; a stale tag only makes us refuse, never corrupt */
+    if (on) {
+        fsetxattr(fd, SPARSE_XATTR, "1", 1, 0);
+    } else {
+        fremovexattr(fd, SPARSE_XATTR);
+    }
+}
+
+/*
+ * `fd' (`fname', described by `st') is about to be inverted. Refuse
+ * if it was inverted hole-preserving but has lost its holes since:
+ * inverting it densely would not give back the original. Returns 0
+ * or -1 with a message printed.
+ */
+int
+sparse_check(int fd, const struct stat *st, const char *fname)
+{
+    if (S_ISREG(st->st_mode) && !sparse_file(st) && sparse_marked(fd)) {
+        fprintf(stderr, "%s: was obfuscated with its holes kept, but has no "
+                "holes now; it cannot be restored this way\n", fname);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Find the first data extent of `fd' in [off, end). On success
+ * returns 1 and stores it, clipped to the range, in `start_out' and
+ * `end_out'. Returns 0 if the rest of the range is a hole and -1 on
+ * error.
+ */
+int
+sparse_next_data(int fd, off_t off, off_t end, off_t *start_out,
+                 off_t *end_out)
+{
+    off_t data, hole;
+
+    if (off >= end) {
+        return 0;
+    }
+
+    data = lseek(fd, off, SEEK_DATA);
+    if (data < 0) {
+        if (errno == ENXIO) {
+            /* Nothing but hole up to EOF */
+            return 0;
+        }
+        if (errno != EINVAL && errno != EOPNOTSUPP) {
+            return -1;
+        }
+        /* No SEEK_DATA here; everything is data */
+        data = off;
+        hole = end;
+    } else if ((hole = lseek(fd, data, SEEK_HOLE)) < 0) {
+        return -1;
+    }
+
+    if (data >= end) {
+        return 0;
+    }
+
+    *start_out = data;
+    *end_out = (hole < end) ? hole : end;
+    return 1;
+}
+
+/*
+ * `buf' holds the `len' bytes of `fd' at `off'. Invert the parts of
+ * it that are data extents in the file and, if `writeback' is set,
+ * write just those parts back. Holes in the buffer are left as
+ * zeros. Returns 0, or -1 with errno set.
+ */
+int
+sparse_invert_buf(const struct cpu_info *info, int fd, char *buf, off_t off,
+                  size_t len, bool writeback)
+{
+    off_t end = off + len;
+    off_t pos = off, data, data_end;
+    uint64_t start;
+    int r;
+
+    while ((r = sparse_next_data(fd, pos, end, &data, &data_end)) > 0) {
+        encrypt_fixed(info, buf + (data - off), data_end - data);
+
+        if (writeback) {
+            start = stats_begin();
+            if (pwrite_full(fd, buf + (data - off), data_end - data,
+                            data) != 0) {
+                return -1;
+            }
+            stats_end(STATS_WRITE, start, data_end - data);
+        }
+
+        pos = data_end;
+    }
+
+    return r;
+}
+
+/*
+ * Invert the data extents of the open file `fd' of `size' bytes in
+ * place, SPARSE_CHUNK at a time. Holes are never read.
+ */
+int
+sparse_invert_file(const struct cpu_info *info, int fd, const char *fname,
+                   size_t size)
+{
+    off_t pos = 0, data, data_end;
+    struct io_stream ios;
+    size_t n;
+    uint64_t start;
+    char *buf;
+    int r;
+
+    if ((buf = malloc(SPARSE_CHUNK)) == NULL) {
+        fprintf(stderr, "Failed to allocate chunk buffer\n");
+        return -1;
+    }
+
+    io_stream_init(&ios, fd, 0, size, size >= IO_SMOOTH_MIN);
+
+    while ((r = sparse_next_data(fd, pos, size, &data, &data_end)) > 0) {
+        for (pos = data; pos < data_end; pos += n) {
+            n = data_end - pos;
+            if (n > SPARSE_CHUNK) {
+                n = SPARSE_CHUNK;
+            }
+
+            start = stats_begin();
+            if (pread_full(fd, buf, n, pos) != (ssize_t)n) {
+                fprintf(stderr, "%s: read failed: %s\n", fname,
+                        strerror(errno != 0 ? errno : EIO));
+                free(buf);
+                return -1;
+            }
+            stats_end(STATS_READ, start, n);
+
+            encrypt_fixed(info, buf, n);
+
+            start = stats_begin();
+            if (pwrite_full(fd, buf, n, pos) != 0) {
+                fprintf(stderr, "%s: write failed: %s\n", fname,
+                        strerror(errno));
+                free(buf);
+                return -1;
+            }
+            io_stream_written(&ios, pos, n);
+            stats_end(STATS_WRITE, start, n);
+        }
+    }
+
+    io_stream_finish(&ios);
+    free(buf);
+    if (r < 0) {
+        fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Invert `buf', the `size' bytes just read from `fname', the way an
+ * in-place run would: holes in the file stay zero in the buffer.
+ * Used before an atomic writeback.
+ */
+int
+sparse_encrypt(const struct cpu_info *info, const char *fname, char *buf,
+               size_t size)
+{
+    struct stat st;
+    int fd, error = 0;
+
+    if ((fd = open(fname, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    if (!sparse_file(&st)) {
+        encrypt(info, buf, size);
+    } else if (sparse_invert_buf(info, fd, buf, 0, size, false) != 0) {
+        fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+        error = -1;
+    }
+
+    close(fd);
+    return error;
+}
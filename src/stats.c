@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2023-2024 Ian Marco Moffett and the Osmora team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Osmora nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/resource.h>
+#include <time.h>
+#include <stats.h>
+
+struct stats g_stats;
+
+static const char *phase_names[STATS_NPHASE] = {
+    [STATS_CPU]     = "cpu",
+    [STATS_READ]    = "read",
+    [STATS_INVERT]  = "invert",
+    [STATS_WRITE]   = "write"
+};
+
+uint64_t
+stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void
+stats_init(bool json)
+{
+    g_stats.enabled = true;
+    g_stats.json = json;
+    g_stats.start_ns = stats_now();
+}
+
+static double
+gbps(uint64_t bytes, uint64_t ns)
+{
+    return (ns == 0) ? 0.0 : (double)bytes / (double)ns;
+}
+
+void
+stats_report(FILE *fp)
+{
+    struct rusage ru;
+    uint64_t wall;
+    const char *kernel;
+
+    if (!g_stats.enabled) {
+        return;
+    }
+
+    wall = stats_now() - g_stats.start_ns;
+    getrusage(RUSAGE_SELF, &ru);
+    kernel = (g_stats.kernel == NULL) ? "none" : g_stats.kernel;
+
+    if (g_stats.json) {
+        fprintf(fp, "{\"kernel\":\"%s\",\"wall_s\":%.9f,\"phases\":{",
+                kernel, wall / 1e9);
+        for (int i = 0; i < STATS_NPHASE; ++i) {
+            fprintf(fp, "%s\"%s\":{\"s\":%.9f,\"bytes\":%ju,\"gbps\":%.3f}",
+                    (i == 0) ? "" : ",", phase_names[i], g_stats.ns[i] / 1e9,
+                    (uintmax_t)g_stats.bytes[i],
+                    gbps(g_stats.bytes[i], g_stats.ns[i]));
+        }
+        fprintf(fp, "},\"minflt\":%ld,\"majflt\":%ld,\"nvcsw\":%ld,"
+                "\"nivcsw\":%ld}\n", ru.ru_minflt, ru.ru_majflt, ru.ru_nvcsw,
+                ru.ru_nivcsw);
+        return;
+    }
+
+    fprintf(fp, "[stats]: kernel      %s\n", kernel);
+    fprintf(fp, "[stats]: wall        %.6f s\n", wall / 1e9);
+    for (int i = 0; i < STATS_NPHASE; ++i) {
+        fprintf(fp, "[stats]: %-10s  %.6f s  %ju bytes  %.3f GB/s\n",
+                phase_names[i], g_stats.ns[i] / 1e9,
+                (uintmax_t)g_stats.bytes[i],
+                gbps(g_stats.bytes[i], g_stats.ns[i]));
+    }
+    fprintf(fp, "[stats]: faults      %ld minor, %ld major\n",
+            ru.ru_minflt, ru.ru_majflt);
+    fprintf(fp, "[stats]: ctxsw       %ld voluntary, %ld involuntary\n",
+            ru.ru_nvcsw, ru.ru_nivcsw);
+}
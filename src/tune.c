@@ -0,0 +1,412 @@
+/*
+ * Copyright (c) 2023-2024 Ian Marco Moffett and the Osmora team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Osmora nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Per-host autotuning.
+ *
+ * --autotune micro-benchmarks the kernels, the non-temporal store
+ * threshold, the streaming chunk size and the thread count on this
+ * machine and writes the winners to a small profile that every
+ * later run loads at startup.
+ */
+
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <encrypt.h>
+#include <fileio.h>
+#include <stats.h>
+#include <tune.h>
+
+#define TUNE_BENCH_SIZE     (64UL << 20)    /* Working set for the benchmarks */
+#define TUNE_BENCH_BYTES    (256UL << 20)   /* Bytes moved per measurement */
+#define TUNE_BENCH_REPS     3               /* Best of this many */
+#define TUNE_MIN_GAIN       1.05            /* Required to prefer the costlier option */
+
+struct tune_profile g_tune = {
+    .kernel = ENCRYPT_NKERNEL - 1,
+    .nt_threshold = SIZE_MAX,
+    .chunk_size = TUNE_DEFAULT_CHUNK,
+    .threads = 1
+};
+
+static int
+profile_path(char *buf, size_t size)
+{
+    const char *env, *base;
+    char host[HOST_NAME_MAX + 1];
+
+    if ((env = getenv(TUNE_ENV)) != NULL) {
+        snprintf(buf, size, "%s", env);
+        return 0;
+    }
+
+    if (gethostname(host, sizeof(host)) != 0) {
+        snprintf(host, sizeof(host), "localhost");
+    }
+    host[sizeof(host) - 1] = '\0';
+
+    /* Home directories may be shared, so key the profile by host */
+    if ((base = getenv("XDG_CACHE_HOME")) != NULL && base[0] != '\0') {
+        snprintf(buf, size, "%s/fobfuscate/%s.profile", base, host);
+    } else if ((base = getenv("HOME")) != NULL && base[0] != '\0') {
+        snprintf(buf, size, "%s/.cache/fobfuscate/%s.profile", base, host);
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Create every missing directory leading up to `path'.
+ */
+static void
+make_parents(const char *path)
+{
+    char tmp[PATH_MAX];
+    char *p;
+
+    snprintf(tmp, sizeof(tmp), "%s", path);
+    for (p = tmp + 1; *p != '\0'; ++p) {
+        if (*p == '/') {
+            *p = '\0';
+            mkdir(tmp, 0755);
+            *p = '/';
+        }
+    }
+}
+
+/*
+ * Load the profile for this host, if there is one. Values the CPU
+ * can't honour are clamped.
+ */
+int
+tune_load(const struct cpu_info *info)
+{
+    char path[PATH_MAX];
+    char line[256];
+    char key[64], val[128];
+    unsigned long long num;
+    FILE *fp;
+
+    if (profile_path(path, sizeof(path)) != 0) {
+        return -1;
+    }
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (line[0] == '#' || sscanf(line, "%63[^=]=%127s", key, val) != 2) {
+            continue;
+        }
+
+        num = strtoull(val, NULL, 0);
+        if (strcmp(key, "kernel") == 0) {
+            for (int k = 0; k < ENCRYPT_NKERNEL; ++k) {
+                if (strcmp(val, encrypt_kernel_name(k)) == 0) {
+                    g_tune.kernel = k;
+                }
+            }
+        } else if (strcmp(key, "nt_threshold") == 0) {
+            g_tune.nt_threshold = (num == 0) ? SIZE_MAX : num;
+        } else if (strcmp(key, "chunk_size") == 0 && num >= 4096) {
+            g_tune.chunk_size = num;
+        } else if (strcmp(key, "threads") == 0 && num >= 1) {
+            g_tune.threads = (num > ENCRYPT_MAX_THREADS) ?
+                ENCRYPT_MAX_THREADS : num;
+        }
+    }
+
+    fclose(fp);
+
+    if (g_tune.kernel > encrypt_max_kernel(info)) {
+        g_tune.kernel = encrypt_max_kernel(info);
+    }
+
+    return 0;
+}
+
+int
+tune_save(void)
+{
+    char path[PATH_MAX];
+    char tmp[PATH_MAX + 8];
+    FILE *fp;
+
+    if (profile_path(path, sizeof(path)) != 0) {
+        fprintf(stderr, "Nowhere to store the profile, set %s\n", TUNE_ENV);
+        return -1;
+    }
+
+    make_parents(path);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    if ((fp = fopen(tmp, "w")) == NULL) {
+        fprintf(stderr, "%s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+
+    fprintf(fp, "# fobfuscate tuning profile, written by --autotune\n");
+    fprintf(fp, "kernel=%s\n", encrypt_kernel_name(g_tune.kernel));
+    fprintf(fp, "nt_threshold=%zu\n",
+            (g_tune.nt_threshold == SIZE_MAX) ? 0 : g_tune.nt_threshold);
+    fprintf(fp, "chunk_size=%zu\n", g_tune.chunk_size);
+    fprintf(fp, "threads=%d\n", g_tune.threads);
+
+    if (fclose(fp) != 0 || rename(tmp, path) != 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+
+    fprintf(stderr, "[tune]: profile written to %s\n", path);
+    return 0;
+}
+
+/*
+ * Throughput in GB/s of inverting the first `size' bytes of `buf'
+ * with the current g_tune, best of TUNE_BENCH_REPS.
+ */
+static double
+bench_invert(const struct cpu_info *info, char *buf, size_t size)
+{
+    size_t iters;
+    uint64_t start, ns;
+    double rate, best = 0.0;
+
+    iters = TUNE_BENCH_BYTES / size;
+    if (iters == 0) {
+        iters = 1;
+    }
+
+    for (int rep = 0; rep < TUNE_BENCH_REPS; ++rep) {
+        start = stats_now();
+        for (size_t i = 0; i < iters; ++i) {
+            encrypt_parallel(info, buf, size, g_tune.threads);
+        }
+        ns = stats_now() - start;
+        rate = (double)(iters * size) / (double)(ns ? ns : 1);
+        if (rate > best) {
+            best = rate;
+        }
+    }
+
+    return best;
+}
+
+/*
+ * Throughput in GB/s of streaming `fd' through a chunk buffer of
+ * `chunk' bytes, reading and inverting as the filter and in-place
+ * paths do.
+ */
+static double
+bench_stream(const struct cpu_info *info, int fd, char *buf, size_t chunk)
+{
+    uint64_t start, ns;
+    double rate, best = 0.0;
+    ssize_t n;
+    off_t off;
+
+    for (int rep = 0; rep < TUNE_BENCH_REPS; ++rep) {
+        start = stats_now();
+        for (off = 0; off < (off_t)TUNE_BENCH_SIZE; off += n) {
+            n = pread_full(fd, buf, chunk, off);
+            if (n <= 0) {
+                return 0.0;
+            }
+            encrypt_fixed(info, buf, n);
+        }
+        ns = stats_now() - start;
+        rate = (double)TUNE_BENCH_SIZE / (double)(ns ? ns : 1);
+        if (rate > best) {
+            best = rate;
+        }
+    }
+
+    return best;
+}
+
+static void
+tune_kernel(const struct cpu_info *info, char *buf)
+{
+    double rate, best = 0.0;
+    int best_kernel = ENCRYPT_SCALAR;
+
+    g_tune.threads = 1;
+    g_tune.nt_threshold = SIZE_MAX;
+
+    for (int k = 0; k <= encrypt_max_kernel(info); ++k) {
+        g_tune.kernel = k;
+        rate = bench_invert(info, buf, TUNE_BENCH_SIZE);
+        fprintf(stderr, "[tune]: kernel %-10s %.3f GB/s\n",
+                encrypt_kernel_name(k), rate);
+        if (rate > best) {
+            best = rate;
+            best_kernel = k;
+        }
+    }
+
+    g_tune.kernel = best_kernel;
+}
+
+static void
+tune_nt(const struct cpu_info *info, char *buf)
+{
+    static const size_t sizes[] = {
+        256UL << 10, 1UL << 20, 4UL << 20, 16UL << 20, TUNE_BENCH_SIZE
+    };
+    double cached, streamed;
+    size_t threshold = SIZE_MAX;
+
+    if (g_tune.kernel < ENCRYPT_SSE) {
+        return;
+    }
+
+    /* Walk down from the largest size while streaming keeps winning */
+    for (int i = sizeof(sizes) / sizeof(sizes[0]) - 1; i >= 0; --i) {
+        g_tune.nt_threshold = SIZE_MAX;
+        cached = bench_invert(info, buf, sizes[i]);
+        g_tune.nt_threshold = 0;
+        streamed = bench_invert(info, buf, sizes[i]);
+
+        fprintf(stderr, "[tune]: %8zu KiB  cached %.3f GB/s  nt %.3f GB/s\n",
+                sizes[i] >> 10, cached, streamed);
+        if (streamed < cached * TUNE_MIN_GAIN) {
+            break;
+        }
+        threshold = sizes[i];
+    }
+
+    g_tune.nt_threshold = threshold;
+}
+
+static void
+tune_chunk(const struct cpu_info *info, char *buf)
+{
+    static const size_t chunks[] = {
+        64UL << 10, 256UL << 10, 1UL << 20, 4UL << 20, 16UL << 20
+    };
+    char path[PATH_MAX];
+    const char *tmpdir;
+    double rate, best = 0.0;
+    int fd;
+
+    tmpdir = getenv("TMPDIR");
+    snprintf(path, sizeof(path), "%s/fobfuscate-tune.XXXXXX",
+             (tmpdir != NULL) ? tmpdir : "/tmp");
+
+    if ((fd = mkstemp(path)) < 0) {
+        fprintf(stderr, "[tune]: %s: %s, keeping chunk size\n", path,
+                strerror(errno));
+        return;
+    }
+    unlink(path);
+
+    if (write_full(fd, buf, TUNE_BENCH_SIZE) != 0) {
+        fprintf(stderr, "[tune]: cannot write scratch file, keeping chunk "
+                "size\n");
+        close(fd);
+        return;
+    }
+
+    for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); ++i) {
+        rate = bench_stream(info, fd, buf, chunks[i]);
+        fprintf(stderr, "[tune]: chunk %6zu KiB  %.3f GB/s\n",
+                chunks[i] >> 10, rate);
+        if (rate > best) {
+            best = rate;
+            g_tune.chunk_size = chunks[i];
+        }
+    }
+
+    close(fd);
+}
+
+static void
+tune_threads(const struct cpu_info *info, char *buf)
+{
+    long ncpu;
+    double rate, best = 0.0;
+    int n, best_threads = 1;
+
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu > ENCRYPT_MAX_THREADS) {
+        ncpu = ENCRYPT_MAX_THREADS;
+    }
+
+    for (n = 1; n <= ncpu; n = (n * 2 > ncpu && n < ncpu) ? ncpu : n * 2) {
+        g_tune.threads = n;
+        rate = bench_invert(info, buf, TUNE_BENCH_SIZE);
+        fprintf(stderr, "[tune]: threads %-4d %.3f GB/s\n", n, rate);
+        if (rate > best * TUNE_MIN_GAIN) {
+            best = rate;
+            best_threads = n;
+        }
+    }
+
+    g_tune.threads = best_threads;
+}
+
+/*
+ * Benchmark this host and store the resulting profile.
+ */
+int
+tune_run(const struct cpu_info *info)
+{
+    char *buf;
+
+    buf = malloc(TUNE_BENCH_SIZE);
+    if (buf == NULL) {
+        fprintf(stderr, "Failed to allocate benchmark buffer\n");
+        return -1;
+    }
+
+    /* Fault the pages in before anything is timed */
+    memset(buf, 0xA5, TUNE_BENCH_SIZE);
+
+    tune_kernel(info, buf);
+    tune_nt(info, buf);
+    tune_chunk(info, buf);
+    tune_threads(info, buf);
+    free(buf);
+
+    fprintf(stderr, "[tune]: kernel=%s nt_threshold=%zu chunk_size=%zu "
+            "threads=%d\n", encrypt_kernel_name(g_tune.kernel),
+            (g_tune.nt_threshold == SIZE_MAX) ? 0 : g_tune.nt_threshold,
+            g_tune.chunk_size, g_tune.threads);
+
+    return tune_save();
+}
@@ -0,0 +1,266 @@
+/*
+ * Copyright (c) 2023-2024 Ian Marco Moffett and the Osmora team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Osmora nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Parallel recursive directory walk.
+ *
+ * Every directory is a task on the work-stealing scheduler. A task
+ * reads its directory with getdents64(2) in large batches, pushes a
+ * task for each subdirectory (for idle workers to steal) and a file
+ * task for each file that passes the filters. d_type saves a stat()
+ * per entry; one is only done when the filesystem doesn't report the
+ * type or a size/mtime filter needs it. A directory already walked
+ * (overlapping arguments, bind mounts) is skipped, and files with
+ * several links are deduplicated by the file task (see batch.c).
+ */
+
+#define _GNU_SOURCE
+#include <sys/syscall.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <fileio.h>
+#include <batch.h>
+#include <walk.h>
+
+#define WALK_BUFSIZE    (64 << 10)
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static const struct walk_filter *filter;
+
+void
+walk_init(const struct walk_filter *f)
+{
+    filter = f;
+}
+
+static bool
+glob_any(char **globs, size_t nglobs, const char *name)
+{
+    for (size_t i = 0; i < nglobs; ++i) {
+        if (fnmatch(globs[i], name, FNM_PERIOD) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool
+want_stat(void)
+{
+    return filter->min_size != 0 || filter->max_size != 0 ||
+           filter->newer != 0 || filter->older != 0;
+}
+
+static bool
+match_stat(const struct stat *st)
+{
+    if (filter->min_size != 0 && st->st_size < filter->min_size) {
+        return false;
+    }
+    if (filter->max_size != 0 && st->st_size > filter->max_size) {
+        return false;
+    }
+    if (filter->newer != 0 && st->st_mtime <= filter->newer) {
+        return false;
+    }
+    if (filter->older != 0 && st->st_mtime >= filter->older) {
+        return false;
+    }
+
+    return true;
+}
+
+static char *
+join_path(const char *dir, const char *name)
+{
+    size_t dlen = strlen(dir);
+    size_t nlen = strlen(name);
+    char *path;
+
+    path = malloc(dlen + nlen + 2);
+    if (path == NULL) {
+        return NULL;
+    }
+
+    memcpy(path, dir, dlen);
+    if (dlen == 0 || dir[dlen - 1] != '/') {
+        path[dlen++] = '/';
+    }
+    memcpy(path + dlen, name, nlen + 1);
+    return path;
+}
+
+static void
+walk_entry(struct wq_worker *w, int dirfd, const char *dir,
+           const struct linux_dirent64 *de)
+{
+    const char *name = de->d_name;
+    unsigned char type = de->d_type;
+    struct wq_task *task;
+    struct stat st;
+    char *path;
+
+    if (glob_any(filter->exclude, filter->nexclude, name)) {
+        return;
+    }
+
+    if (type == DT_UNKNOWN || (type == DT_REG && want_stat())) {
+        if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            fprintf(stderr, "%s/%s: %s\n", dir, name, strerror(errno));
+            workq_error(w);
+            return;
+        }
+        type = S_ISDIR(st.st_mode) ? DT_DIR :
+               S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        if (type == DT_REG && !match_stat(&st)) {
+            return;
+        }
+    }
+
+    /* Symlinks, devices, sockets and the like are never followed */
+    if (type != DT_DIR && type != DT_REG) {
+        return;
+    }
+
+    if (type == DT_REG && is_sidecar(name)) {
+        fprintf(stderr, "%s/%s: journal or temporary file, skipped\n", dir,
+                name);
+        return;
+    }
+
+    if (type == DT_REG && filter->ninclude != 0 &&
+        !glob_any(filter->include, filter->ninclude, name)) {
+        return;
+    }
+
+    if ((path = join_path(dir, name)) == NULL) {
+        fprintf(stderr, "%s/%s: %s\n", dir, name, strerror(ENOMEM));
+        workq_error(w);
+        return;
+    }
+
+    task = (type == DT_DIR) ? walk_task(path) : batch_file_task(path);
+    if (task == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(ENOMEM));
+        workq_error(w);
+        free(path);
+        return;
+    }
+
+    workq_push(w, task);
+}
+
+static void
+dir_task(struct wq_worker *w, struct wq_task *task)
+{
+    char *dir = task->arg;
+    const struct linux_dirent64 *de;
+    struct stat st;
+    char *buf;
+    long n;
+    int fd;
+
+    free(task);
+
+    fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+        workq_error(w);
+        free(dir);
+        return;
+    }
+
+    /* Overlapping arguments or bind mounts: walk each directory once */
+    if (fstat(fd, &st) == 0 && batch_seen(&st)) {
+        close(fd);
+        free(dir);
+        return;
+    }
+
+    /* The scratch buffer belongs to file work, use our own */
+    if ((buf = malloc(WALK_BUFSIZE)) == NULL) {
+        fprintf(stderr, "%s: %s\n", dir, strerror(ENOMEM));
+        workq_error(w);
+        close(fd);
+        free(dir);
+        return;
+    }
+
+    while ((n = syscall(SYS_getdents64, fd, buf, WALK_BUFSIZE)) > 0) {
+        for (long off = 0; off < n; off += de->d_reclen) {
+            de = (const struct linux_dirent64 *)(buf + off);
+            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+                continue;
+            }
+            walk_entry(w, fd, dir, de);
+        }
+    }
+
+    if (n < 0) {
+        fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+        workq_error(w);
+    }
+
+    free(buf);
+    close(fd);
+    free(dir);
+}
+
+/*
+ * Make a task that walks the directory `path' (which it takes
+ * ownership of).
+ */
+struct wq_task *
+walk_task(char *path)
+{
+    struct wq_task *task;
+
+    if ((task = malloc(sizeof(*task))) == NULL) {
+        return NULL;
+    }
+
+    task->run = dir_task;
+    task->arg = path;
+    return task;
+}
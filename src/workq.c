@@ -0,0 +1,354 @@
+/*
+ * Copyright (c) 2023-2024 Ian Marco Moffett and the Osmora team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Osmora nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Work-stealing scheduler.
+ *
+ * Every worker owns a deque. It pushes and pops at the bottom, so it
+ * keeps working on what it split most recently (still in cache),
+ * while idle workers steal the oldest tasks from the top of a
+ * victim's deque. A batch of one huge file and many tiny ones thus
+ * keeps every core busy until the very end: the huge file becomes
+ * chunk tasks that whoever runs dry can take.
+ *
+ * The deques are short mutex-protected rings; tasks here are
+ * microseconds to milliseconds of I/O each, so lock-free deques
+ * would not buy anything measurable.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <workq.h>
+
+#define WQ_INITIAL_CAP  64
+#define WQ_IDLE_NS      1000000     /* Upper bound on a missed wakeup */
+
+static int
+deque_init(struct wq_deque *dq)
+{
+    dq->slots = malloc(WQ_INITIAL_CAP * sizeof(*dq->slots));
+    if (dq->slots == NULL) {
+        return -1;
+    }
+
+    dq->cap = WQ_INITIAL_CAP;
+    dq->top = 0;
+    dq->bottom = 0;
+    pthread_mutex_init(&dq->lock, NULL);
+    return 0;
+}
+
+static void
+deque_push(struct wq_deque *dq, struct wq_task *task)
+{
+    struct wq_task **slots;
+    size_t n;
+
+    pthread_mutex_lock(&dq->lock);
+    n = dq->bottom - dq->top;
+    if (n == dq->cap) {
+        slots = malloc(dq->cap * 2 * sizeof(*slots));
+        if (slots == NULL) {
+            /* Dropping a task would silently skip data */
+            fprintf(stderr, "Out of memory queueing work\n");
+            abort();
+        }
+        for (size_t i = 0; i < n; ++i) {
+            slots[i] = dq->slots[(dq->top + i) % dq->cap];
+        }
+        free(dq->slots);
+        dq->slots = slots;
+        dq->cap *= 2;
+        dq->top = 0;
+        dq->bottom = n;
+    }
+    dq->slots[dq->bottom++ % dq->cap] = task;
+    pthread_mutex_unlock(&dq->lock);
+}
+
+static struct wq_task *
+deque_pop(struct wq_deque *dq)
+{
+    struct wq_task *task = NULL;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom != dq->top) {
+        task = dq->slots[--dq->bottom % dq->cap];
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return task;
+}
+
+static struct wq_task *
+deque_steal(struct wq_deque *dq)
+{
+    struct wq_task *task = NULL;
+
+    if (pthread_mutex_trylock(&dq->lock) != 0) {
+        return NULL;
+    }
+    if (dq->bottom != dq->top) {
+        task = dq->slots[dq->top++ % dq->cap];
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return task;
+}
+
+static void
+wake_idle(struct workq *wq, bool all)
+{
+    if (__atomic_load_n(&wq->nidle, __ATOMIC_ACQUIRE) == 0 && !all) {
+        return;
+    }
+
+    pthread_mutex_lock(&wq->idle_lock);
+    ++wq->gen;
+    if (all) {
+        pthread_cond_broadcast(&wq->idle_cv);
+    } else {
+        pthread_cond_signal(&wq->idle_cv);
+    }
+    pthread_mutex_unlock(&wq->idle_lock);
+}
+
+int
+workq_init(struct workq *wq, int nworkers, size_t scratch_size)
+{
+    memset(wq, 0, sizeof(*wq));
+    if (nworkers < 1) {
+        nworkers = 1;
+    }
+
+    wq->workers = calloc(nworkers, sizeof(*wq->workers));
+    if (wq->workers == NULL) {
+        return -1;
+    }
+
+    wq->nworkers = nworkers;
+    wq->scratch_size = scratch_size;
+    pthread_mutex_init(&wq->idle_lock, NULL);
+    pthread_cond_init(&wq->idle_cv, NULL);
+
+    for (int i = 0; i < nworkers; ++i) {
+        wq->workers[i].wq = wq;
+        wq->workers[i].id = i;
+        wq->workers[i].seed = i * 2654435761U + 1;
+        if (deque_init(&wq->workers[i].dq) != 0) {
+            workq_destroy(wq);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Queue a task before workq_run(). Tasks are dealt out round-robin.
+ */
+void
+workq_submit(struct workq *wq, struct wq_task *task)
+{
+    struct wq_worker *w;
+
+    w = &wq->workers[wq->pending % wq->nworkers];
+    ++wq->pending;
+    deque_push(&w->dq, task);
+}
+
+/*
+ * Queue `n' tasks before workq_run() so that each worker starts on a
+ * contiguous run of them and works through it in order; for when the
+ * order means something, like disk layout. Each run is pushed back to
+ * front since the owner pops from the bottom; thieves then take from
+ * the far end of a run.
+ */
+void
+workq_submit_runs(struct workq *wq, struct wq_task **tasks, size_t n)
+{
+    size_t per = (n + wq->nworkers - 1) / wq->nworkers;
+    size_t lo, hi;
+
+    for (int i = 0; i < wq->nworkers; ++i) {
+        lo = i * per;
+        hi = (lo + per < n) ? lo + per : n;
+        for (size_t j = hi; j-- > lo;) {
+            ++wq->pending;
+            deque_push(&wq->workers[i].dq, tasks[j]);
+        }
+    }
+}
+
+/*
+ * Queue a task from inside a running task.
+ */
+void
+workq_push(struct wq_worker *w, struct wq_task *task)
+{
+    __atomic_add_fetch(&w->wq->pending, 1, __ATOMIC_ACQ_REL);
+    deque_push(&w->dq, task);
+    wake_idle(w->wq, false);
+}
+
+void
+workq_error(struct wq_worker *w)
+{
+    __atomic_add_fetch(&w->wq->nerrors, 1, __ATOMIC_RELAXED);
+}
+
+static struct wq_task *
+find_task(struct wq_worker *w)
+{
+    struct workq *wq = w->wq;
+    struct wq_task *task;
+    int start;
+
+    if ((task = deque_pop(&w->dq)) != NULL) {
+        return task;
+    }
+
+    start = rand_r(&w->seed) % wq->nworkers;
+    for (int i = 0; i < wq->nworkers; ++i) {
+        struct wq_worker *victim = &wq->workers[(start + i) % wq->nworkers];
+
+        if (victim != w && (task = deque_steal(&victim->dq)) != NULL) {
+            return task;
+        }
+    }
+
+    return NULL;
+}
+
+static void
+idle_wait(struct workq *wq)
+{
+    struct timespec ts;
+    uint64_t gen;
+
+    pthread_mutex_lock(&wq->idle_lock);
+    gen = wq->gen;
+    ++wq->nidle;
+    if (__atomic_load_n(&wq->pending, __ATOMIC_ACQUIRE) != 0) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += WQ_IDLE_NS;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_nsec -= 1000000000L;
+            ++ts.tv_sec;
+        }
+        while (wq->gen == gen && __atomic_load_n(&wq->pending,
+               __ATOMIC_ACQUIRE) != 0) {
+            if (pthread_cond_timedwait(&wq->idle_cv, &wq->idle_lock,
+                                       &ts) == ETIMEDOUT) {
+                break;
+            }
+        }
+    }
+    --wq->nidle;
+    pthread_mutex_unlock(&wq->idle_lock);
+}
+
+static void *
+worker_main(void *arg)
+{
+    struct wq_worker *w = arg;
+    struct workq *wq = w->wq;
+    struct wq_task *task;
+
+    for (;;) {
+        if ((task = find_task(w)) != NULL) {
+            task->run(w, task);
+            if (__atomic_sub_fetch(&wq->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+                wake_idle(wq, true);
+            }
+            continue;
+        }
+
+        if (__atomic_load_n(&wq->pending, __ATOMIC_ACQUIRE) == 0) {
+            break;
+        }
+        idle_wait(wq);
+    }
+
+    return NULL;
+}
+
+/*
+ * Run until every task, including those spawned along the way, is
+ * done. Returns the number of tasks that reported an error.
+ */
+int
+workq_run(struct workq *wq)
+{
+    struct wq_worker *w;
+    bool started[wq->nworkers];
+
+    for (int i = 0; i < wq->nworkers; ++i) {
+        w = &wq->workers[i];
+        if (wq->scratch_size != 0 && w->scratch == NULL) {
+            w->scratch = malloc(wq->scratch_size);
+            if (w->scratch == NULL) {
+                fprintf(stderr, "Failed to allocate worker buffers\n");
+                return -1;
+            }
+        }
+    }
+
+    for (int i = 1; i < wq->nworkers; ++i) {
+        w = &wq->workers[i];
+        started[i] = pthread_create(&w->thread, NULL, worker_main, w) == 0;
+    }
+
+    worker_main(&wq->workers[0]);
+
+    for (int i = 1; i < wq->nworkers; ++i) {
+        if (started[i]) {
+            pthread_join(wq->workers[i].thread, NULL);
+        }
+    }
+
+    return wq->nerrors;
+}
+
+void
+workq_destroy(struct workq *wq)
+{
+    for (int i = 0; i < wq->nworkers; ++i) {
+        free(wq->workers[i].scratch);
+        free(wq->workers[i].dq.slots);
+        pthread_mutex_destroy(&wq->workers[i].dq.lock);
+    }
+
+    pthread_cond_destroy(&wq->idle_cv);
+    pthread_mutex_destroy(&wq->idle_lock);
+    free(wq->workers);
+    wq->workers = NULL;
+}
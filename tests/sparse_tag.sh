@@ -0,0 +1,50 @@
+#!/bin/sh
+#
+# A sparse file inverted with its holes kept is tagged, and is refused
+# where inverting it again would not give back the original.
+#
+
+set -e
+
+BIN=${BIN:-bin/fobfuscate}
+tmp=$(mktemp -d "${TMPDIR:-/var/tmp}/fob.XXXXXX")
+trap 'rm -rf "$tmp"' EXIT
+
+truncate -s 1M "$tmp/img"
+printf 'secret\n' | dd of="$tmp/img" bs=1 seek=65536 conv=notrunc 2>/dev/null
+cp --sparse=always "$tmp/img" "$tmp/img.orig"
+
+tagged() {
+    python3 -c 'import os, sys; os.getxattr(sys.argv[1], sys.argv[2])' \
+        "$1" user.fobfuscate.sparse 2>/dev/null
+}
+
+if ! python3 -c 'import os, sys; os.setxattr(sys.argv[1], "user.t", b"1")' \
+        "$tmp/img.orig" 2>/dev/null; then
+    echo "sparse_tag: no user xattrs (or python3) here, skipped"
+    exit 0
+fi
+
+"$BIN" "$tmp/img"
+tagged "$tmp/img"
+
+# Filtering or decoding a copy without the holes must be refused
+if "$BIN" - < "$tmp/img" > "$tmp/out" 2>/dev/null; then
+    echo "sparse_tag: filter mode accepted a tagged file" >&2
+    exit 1
+fi
+cp --sparse=never --preserve=xattr "$tmp/img" "$tmp/dense"
+if "$BIN" "$tmp/dense" 2>/dev/null; then
+    echo "sparse_tag: decoded a tagged file that lost its holes" >&2
+    exit 1
+fi
+
+# In place it round-trips and loses the tag
+"$BIN" "$tmp/img"
+cmp "$tmp/img" "$tmp/img.orig"
+if tagged "$tmp/img"; then
+    echo "sparse_tag: tag left on a decoded file" >&2
+    exit 1
+fi
+
+echo "sparse_tag: ok"
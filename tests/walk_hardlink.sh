@@ -0,0 +1,31 @@
+#!/bin/sh
+#
+# A file reached twice under -R (through a hard link, or through
+# overlapping arguments) must be inverted exactly once.
+#
+
+set -e
+
+BIN=${BIN:-bin/fobfuscate}
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+mkdir -p "$tmp/d/sub"
+printf 'secret\n' > "$tmp/d/a"
+printf 'other\n' > "$tmp/d/b"
+ln "$tmp/d/a" "$tmp/d/sub/a_link"
+cp "$tmp/d/a" "$tmp/a.orig"
+cp "$tmp/d/b" "$tmp/b.orig"
+
+"$BIN" -R "$tmp/d"
+if cmp -s "$tmp/d/a" "$tmp/a.orig"; then
+    echo "walk_hardlink: hard-linked file was inverted twice" >&2
+    exit 1
+fi
+
+# Overlapping directory and file arguments: everything once more
+"$BIN" -R "$tmp/d" "$tmp/d/sub" "$tmp/d/b"
+cmp "$tmp/d/a" "$tmp/a.orig"
+cmp "$tmp/d/b" "$tmp/b.orig"
+
+echo "walk_hardlink: ok"